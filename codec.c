@@ -0,0 +1,273 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "codec.h"
+
+#include <string.h>		/* for memcpy, memset */
+#include <stdint.h>		/* for uint32_t */
+#include <arpa/inet.h>		/* for htonl, ntohl */
+
+#include "config.h"		/* compiled in defaults */
+
+/* LZ4 block format: a sequence is a token (literal length and match
+ * length - 4 in 4 bits each, 15 continues with octets up to 255), the
+ * literals, the offset of the match (2 octets, little endian) and the
+ * continuation of the match length. The last sequence has literals only.
+ * Matches start at most 12 octets and end at most 5 octets before the end */
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	
+	memcpy( &v, p, sizeof( v ) );
+	
+	return v;
+}
+
+static uint32_t lz_hash( const uint32_t v )
+{
+	return ( v * 2654435761U ) >> ( 32 - LZ_HASH_BITS );
+}
+
+static unsigned char *put_length( unsigned char *op, size_t n )
+{
+	for( ; n >= 255; n -= 255 ) {
+		*op++ = 255;
+	}
+	*op++ = (unsigned char)n;
+	
+	return op;
+}
+
+/* append a sequence, a match length of 0 for the last literals. Returns
+ * NULL if it doesn't fit */
+static unsigned char *put_sequence( unsigned char *op, const unsigned char *end, const unsigned char *lit, const size_t lit_len, const size_t offset, const size_t match_len )
+{
+	unsigned char *token;
+	
+	if( (size_t)( end - op ) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 ) {
+		return NULL;
+	}
+	
+	token = op++;
+	if( lit_len >= 15 ) {
+		*token = 15 << 4;
+		op = put_length( op, lit_len - 15 );
+	} else {
+		*token = lit_len << 4;
+	}
+	memcpy( op, lit, lit_len );
+	op += lit_len;
+	
+	if( match_len > 0 ) {
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		if( match_len - LZ_MIN_MATCH >= 15 ) {
+			*token |= 15;
+			op = put_length( op, match_len - LZ_MIN_MATCH - 15 );
+		} else {
+			*token |= match_len - LZ_MIN_MATCH;
+		}
+	}
+	
+	return op;
+}
+
+/* greedy compression with one hash probe per position. The step grows
+ * with every miss, so incompressible data is passed over quickly. Returns
+ * the compressed length or 0 if it doesn't fit into 'max' octets */
+static size_t lz_compress( const unsigned char *src, const size_t len, unsigned char *dst, const size_t max )
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *end = dst + max;
+	unsigned char *op = dst;
+	size_t ip = 0;
+	size_t anchor = 0;
+	size_t misses = 0;
+	size_t ref;
+	size_t match_len;
+	uint32_t h;
+	
+	memset( table, 0, sizeof( table ) );
+	
+	while( ip + LZ_MATCH_LIMIT <= len ) {
+		h = lz_hash( read32( src + ip ) );
+		ref = table[h];
+		table[h] = ip;
+		
+		if( ref < ip && ip - ref <= LZ_MAX_OFFSET && read32( src + ref ) == read32( src + ip ) ) {
+			match_len = LZ_MIN_MATCH;
+			while( ip + match_len < len - LZ_LAST_LITERALS && src[ref + match_len] == src[ip + match_len] ) {
+				match_len++;
+			}
+			
+			op = put_sequence( op, end, src + anchor, ip - anchor, ip - ref, match_len );
+			if( op == NULL ) {
+				return 0;
+			}
+			
+			ip += match_len;
+			anchor = ip;
+			misses = 0;
+		} else {
+			ip += 1 + ( misses++ >> COMPRESS_SKIP_TRIGGER );
+		}
+	}
+	
+	op = put_sequence( op, end, src + anchor, len - anchor, 0, 0 );
+	if( op == NULL ) {
+		return 0;
+	}
+	
+	return op - dst;
+}
+
+static int get_length( const unsigned char *src, const size_t len, size_t *ip, size_t *n )
+{
+	unsigned char b;
+	
+	do {
+		if( *ip >= len ) {
+			return -1;
+		}
+		b = src[(*ip)++];
+		*n += b;
+	} while( b == 255 );
+	
+	return 0;
+}
+
+/* decompress exactly 'out_len' octets, any malformed input is an error */
+static int lz_decompress( const unsigned char *src, const size_t len, unsigned char *dst, const size_t out_len )
+{
+	size_t ip = 0;
+	size_t op = 0;
+	size_t lit_len;
+	size_t match_len;
+	size_t offset;
+	unsigned char token;
+	
+	while( ip < len ) {
+		token = src[ip++];
+		
+		lit_len = token >> 4;
+		if( lit_len == 15 && get_length( src, len, &ip, &lit_len ) < 0 ) {
+			return -1;
+		}
+		if( lit_len > len - ip || lit_len > out_len - op ) {
+			return -1;
+		}
+		memcpy( dst + op, src + ip, lit_len );
+		ip += lit_len;
+		op += lit_len;
+		
+		/* the last sequence */
+		if( ip == len ) {
+			break;
+		}
+		
+		if( len - ip < 2 ) {
+			return -1;
+		}
+		offset = src[ip] | ( src[ip + 1] << 8 );
+		ip += 2;
+		if( offset == 0 || offset > op ) {
+			return -1;
+		}
+		
+		match_len = token & 15;
+		if( match_len == 15 && get_length( src, len, &ip, &match_len ) < 0 ) {
+			return -1;
+		}
+		match_len += LZ_MIN_MATCH;
+		if( match_len > out_len - op ) {
+			return -1;
+		}
+		
+		/* the match can overlap the data it produces */
+		for( ; match_len > 0; match_len--, op++ ) {
+			dst[op] = dst[op - offset];
+		}
+	}
+	
+	return ( op == out_len ) ? 0 : -1;
+}
+
+/* frame 'len' octets, compressed if that saves space. 'dst' must hold
+ * CODEC_FRAME_MAX( len ) octets, returns the length of the frame */
+size_t codec_encode( const char *src, const size_t len, char *dst )
+{
+	uint32_t n = htonl( len );
+	size_t compressed = 0;
+	
+	if( len >= COMPRESS_MIN_SIZE ) {
+		compressed = lz_compress( (const unsigned char *)src, len,
+			(unsigned char *)dst + CODEC_HEADER_SIZE, len - 1 );
+	}
+	
+	if( compressed > 0 ) {
+		dst[0] = CODEC_LZ;
+	} else {
+		dst[0] = CODEC_STORED;
+		memcpy( dst + CODEC_HEADER_SIZE, src, len );
+		compressed = len;
+	}
+	memcpy( dst + 1, &n, sizeof( n ) );
+	
+	return CODEC_HEADER_SIZE + compressed;
+}
+
+/* unpack a frame into 'dst' of 'max' octets, returns the length of the
+ * data or -1 if the frame is corrupt */
+int codec_decode( const char *src, const size_t len, char *dst, const size_t max )
+{
+	uint32_t n;
+	
+	if( len < CODEC_HEADER_SIZE ) {
+		return -1;
+	}
+	memcpy( &n, src + 1, sizeof( n ) );
+	n = ntohl( n );
+	if( n > max ) {
+		return -1;
+	}
+	
+	switch( src[0] ) {
+		case CODEC_STORED:
+			if( len - CODEC_HEADER_SIZE != n ) {
+				return -1;
+			}
+			memcpy( dst, src + CODEC_HEADER_SIZE, n );
+			return n;
+		
+		case CODEC_LZ:
+			if( lz_decompress( (const unsigned char *)src + CODEC_HEADER_SIZE,
+				len - CODEC_HEADER_SIZE, (unsigned char *)dst, n ) < 0 ) {
+				return -1;
+			}
+			return n;
+		
+		default:
+			return -1;
+	}
+}
@@ -0,0 +1,41 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <sys/types.h>		/* size_t */
+
+/* --- frames of compressed data blocks ---
+ *
+ * a frame starts with a header of one octet for the codec and the length
+ * of the uncompressed data (4 octets, big endian), followed by the data.
+ * Compressed data is in the LZ4 block format */
+
+#define CODEC_HEADER_SIZE	5
+
+#define CODEC_STORED		0	/* the data is stored as it is */
+#define CODEC_LZ		1	/* the data is LZ compressed */
+
+/* maximal length of the frame of 'len' octets */
+#define CODEC_FRAME_MAX( len )	( ( len ) + CODEC_HEADER_SIZE )
+
+size_t codec_encode( const char *src, const size_t len, char *dst );
+
+int codec_decode( const char *src, const size_t len, char *dst, const size_t max );
+
+#endif
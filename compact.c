@@ -0,0 +1,170 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compact.h"
+
+#include <string.h>		/* for memset */
+#include <stdio.h>		/* for snprintf */
+#include <errno.h>		/* for ENOENT and friends */
+#include <syslog.h>		/* for syslog */
+#include <inttypes.h>		/* for PRIxxx macros */
+#include <time.h>		/* for clock_gettime */
+
+#include "pgsql.h"		/* for psql_compact_file */
+#include "config.h"		/* compiled in defaults */
+
+/* the log engine appends partial writes as extents, the compaction folds
+ * them back into the blocks, so reads don't have to merge long logs */
+
+static int compact_file( PgCompactor *compactor, const int64_t id )
+{
+	PGresult *res;
+	PgFuseFile *f;
+	char path[64];
+	int rc;
+
+	snprintf( path, sizeof( path ), "#%"PRIi64, id );
+
+	/* writes of the file must not interleave with the compaction */
+	f = file_table_lookup( compactor->files, id );
+	if( f != NULL ) {
+		file_lock( compactor->files, f );
+	} else {
+		file_table_lock_id( compactor->files, id );
+	}
+
+	res = PQexec( compactor->conn, "BEGIN" );
+	rc = ( PQresultStatus( res ) == PGRES_COMMAND_OK ) ? 0 : -EIO;
+	PQclear( res );
+
+	if( rc == 0 ) {
+		rc = psql_compact_file( compactor->conn, compactor->block_size, id, path, compactor->verbose );
+
+		res = PQexec( compactor->conn, rc < 0 ? "ROLLBACK" : "COMMIT" );
+		if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+			rc = -EIO;
+		}
+		PQclear( res );
+	}
+
+	if( f != NULL ) {
+		file_unlock( compactor->files, f );
+		(void)file_table_close( compactor->files, f );
+	} else {
+		file_table_unlock_id( compactor->files, id );
+	}
+
+	if( rc < 0 ) {
+		syslog( LOG_ERR, "Compaction of file '%s' failed: %s",
+			path, PQerrorMessage( compactor->conn ) );
+	}
+
+	return rc;
+}
+
+static void *compact_thread( void *arg )
+{
+	PgCompactor *compactor = (PgCompactor *)arg;
+	int64_t ids[COMPACT_MAX_FILES];
+	struct timespec deadline;
+	int nof_ids;
+	int i;
+
+	(void)pthread_mutex_lock( &compactor->lock );
+
+	while( !compactor->stop ) {
+		(void)clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += compactor->interval;
+
+		(void)pthread_cond_timedwait( &compactor->cond, &compactor->lock, &deadline );
+		if( compactor->stop ) {
+			break;
+		}
+
+		(void)pthread_mutex_unlock( &compactor->lock );
+
+		nof_ids = psql_compact_candidates( compactor->conn, ids, COMPACT_MAX_FILES );
+		for( i = 0; i < nof_ids; i++ ) {
+			(void)compact_file( compactor, ids[i] );
+		}
+
+		(void)pthread_mutex_lock( &compactor->lock );
+	}
+
+	(void)pthread_mutex_unlock( &compactor->lock );
+
+	return NULL;
+}
+
+int compact_init( PgCompactor *compactor, const char *conninfo, PgFileTable *files, const size_t block_size, const unsigned int interval, int verbose )
+{
+	int res;
+
+	memset( compactor, 0, sizeof( PgCompactor ) );
+	compactor->files = files;
+	compactor->block_size = block_size;
+	compactor->interval = interval;
+	compactor->verbose = verbose;
+
+	compactor->conn = PQconnectdb( conninfo );
+	if( PQstatus( compactor->conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database failed: %s",
+			PQerrorMessage( compactor->conn ) );
+		PQfinish( compactor->conn );
+		return -EIO;
+	}
+
+	res = pthread_mutex_init( &compactor->lock, NULL );
+	if( res != 0 ) {
+		PQfinish( compactor->conn );
+		return -res;
+	}
+
+	res = pthread_cond_init( &compactor->cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &compactor->lock );
+		PQfinish( compactor->conn );
+		return -res;
+	}
+
+	res = pthread_create( &compactor->thread, NULL, compact_thread, compactor );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &compactor->cond );
+		(void)pthread_mutex_destroy( &compactor->lock );
+		PQfinish( compactor->conn );
+		return -res;
+	}
+
+	return 0;
+}
+
+int compact_destroy( PgCompactor *compactor )
+{
+	(void)pthread_mutex_lock( &compactor->lock );
+	compactor->stop = 1;
+	(void)pthread_cond_signal( &compactor->cond );
+	(void)pthread_mutex_unlock( &compactor->lock );
+
+	(void)pthread_join( compactor->thread, NULL );
+
+	PQfinish( compactor->conn );
+
+	(void)pthread_cond_destroy( &compactor->cond );
+	(void)pthread_mutex_destroy( &compactor->lock );
+
+	return 0;
+}
@@ -27,6 +27,83 @@
 
 #define DEFAULT_BLOCK_SIZE	4096
 
+/* default size of the write-back buffer for dirty blocks of all open
+ * files, 0 disables buffering and every write goes to the database */
+
+#define DEFAULT_WRITE_BUFFER_SIZE	1048576
+
+/* seconds after which the size and modification time of a file being
+ * written are persisted even if it is not flushed or closed */
+
+#define META_SYNC_INTERVAL	5
+
+/* milliseconds after which a group transaction of a bulk load is
+ * committed, even if it has less operations than requested */
+
+#define DEFAULT_BULKLOAD_DELAY	1000
+
+/* size up to which new files are spooled locally till they are closed */
+
+#define DEFAULT_SPOOL_MAX	1048576
+
+/* smallest part of a big write uploaded on a connection of its own in
+ * parallel mode */
+
+#define PARALLEL_MIN_RANGE	65536
+
+/* maximum number of statements sent in pipeline mode before their
+ * results are read */
+
+#define PIPELINE_MAX_PENDING	64
+
+/* the block size of a file grows by that factor up to the maximum while
+ * the file has only one block */
+
+#define BLOCK_SIZE_GROWTH	16
+#define MAX_BLOCK_SIZE		1048576
+
+/* files up to that size and symlinks are stored inline in their directory
+ * entry, at most one block */
+
+#define INLINE_MAX_SIZE		2048
+
+/* blocks shorter than that are not compressed, the compressor skips one
+ * more octet per probe after every 2^COMPRESS_SKIP_TRIGGER misses in a row */
+
+#define COMPRESS_MIN_SIZE	64
+#define COMPRESS_SKIP_TRIGGER	6
+
+/* seconds between two runs of the compaction of the log engine and files
+ * compacted per run */
+
+#define COMPACT_INTERVAL	10
+#define COMPACT_MAX_FILES	64
+
+/* seconds between two runs of the reaper of unlinked files, files per
+ * page of candidates, rows deleted per transaction and milliseconds of
+ * rest after each transaction */
+
+#define REAP_INTERVAL		10
+#define REAP_MAX_FILES		64
+#define REAP_BATCH		1024
+#define REAP_PAUSE		20
+
+/* number of hash buckets in the table of open files */
+
+#define FILE_TABLE_SIZE		256
+
+/* number of locks the inodes are spread over, changes of the same inode
+ * are serialized in the process before they reach the database */
+
+#define FILE_LOCK_STRIPES	64
+
+/* attempts of a transaction aborted by a deadlock or a serialization
+ * failure and milliseconds of pause before the first retry, doubled for
+ * every further one */
+
+#define RETRY_MAX_ATTEMPTS	5
+#define RETRY_PAUSE		10
+
 /* maximum length of a filename , rather arbitrary choice */
 
 #define MAX_FILENAME_LENGTH	4096
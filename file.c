@@ -0,0 +1,855 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "file.h"
+
+#include <string.h>		/* for memcpy, memmove */
+#include <errno.h>		/* for ENOENT and friends */
+#include <stdlib.h>		/* for malloc */
+#include <syslog.h>		/* for syslog */
+#include <inttypes.h>		/* for PRIxxx macros */
+#include <unistd.h>		/* for pread, pwrite, close */
+#include <stdio.h>		/* for snprintf */
+#include <limits.h>		/* for PATH_MAX */
+
+#include "config.h"		/* compiled in defaults */
+#include "pgsql.h"		/* for psql_write_buf */
+
+/* --- table of open files --- */
+
+int file_table_init( PgFileTable *table, const size_t block_size, const int engine, const size_t dirty_max )
+{
+	int res;
+	size_t i;
+
+	table->buckets = (PgFuseFile **)calloc( FILE_TABLE_SIZE, sizeof( PgFuseFile * ) );
+	if( table->buckets == NULL ) {
+		return -ENOMEM;
+	}
+
+	table->block_size = block_size;
+	table->engine = engine;
+	table->dirty_bytes = 0;
+	table->dirty_max = dirty_max;
+
+	res = pthread_mutex_init( &table->lock, NULL );
+	if( res < 0 ) {
+		free( table->buckets );
+		return res;
+	}
+
+	for( i = 0; i < FILE_LOCK_STRIPES; i++ ) {
+		res = pthread_mutex_init( &table->stripes[i], NULL );
+		if( res < 0 ) {
+			while( i > 0 ) {
+				(void)pthread_mutex_destroy( &table->stripes[--i] );
+			}
+			(void)pthread_mutex_destroy( &table->lock );
+			free( table->buckets );
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+static void free_file( PgFuseFile *file )
+{
+	size_t i;
+
+	for( i = 0; i < file->nof_dirty; i++ ) {
+		free( file->dirty[i].data );
+	}
+	free( file->dirty );
+	if( file->spool_fd >= 0 ) {
+		(void)close( file->spool_fd );
+	}
+	free( file->path );
+	(void)pthread_mutex_destroy( &file->lock );
+	free( file );
+}
+
+int file_table_destroy( PgFileTable *table )
+{
+	size_t i;
+	PgFuseFile *file;
+	PgFuseFile *next;
+
+	for( i = 0; i < FILE_TABLE_SIZE; i++ ) {
+		for( file = table->buckets[i]; file != NULL; file = next ) {
+			next = file->next;
+			if( file->nof_dirty > 0 ) {
+				syslog( LOG_ERR, "Destroying open file with id '%"PRIi64"' with %zu unwritten dirty blocks",
+					file->id, file->nof_dirty );
+			}
+			free_file( file );
+		}
+	}
+
+	for( file = table->spooled; file != NULL; file = next ) {
+		next = file->next;
+		syslog( LOG_ERR, "Destroying spooled file '%s' which has not been stored",
+			file->path );
+		free_file( file );
+	}
+
+	free( table->buckets );
+
+	for( i = 0; i < FILE_LOCK_STRIPES; i++ ) {
+		(void)pthread_mutex_destroy( &table->stripes[i] );
+	}
+
+	return pthread_mutex_destroy( &table->lock );
+}
+
+PgFuseFile *file_table_open( PgFileTable *table, const int64_t id, const int64_t size, const size_t block_size, const Oid lo_oid, const int codec )
+{
+	PgFuseFile *file;
+	size_t bucket = id % FILE_TABLE_SIZE;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return NULL;
+	}
+
+	for( file = table->buckets[bucket]; file != NULL; file = file->next ) {
+		if( file->id == id ) {
+			file->refcount++;
+			(void)pthread_mutex_unlock( &table->lock );
+			return file;
+		}
+	}
+
+	file = (PgFuseFile *)calloc( 1, sizeof( PgFuseFile ) );
+	if( file == NULL ) {
+		(void)pthread_mutex_unlock( &table->lock );
+		return NULL;
+	}
+
+	if( pthread_mutex_init( &file->lock, NULL ) < 0 ) {
+		free( file );
+		(void)pthread_mutex_unlock( &table->lock );
+		return NULL;
+	}
+
+	file->id = id;
+	file->refcount = 1;
+	file->spool_fd = -1;
+	file->stored_size = size;
+	file->block_size = ( block_size > 0 ) ? block_size : table->block_size;
+	file->lo_oid = lo_oid;
+	file->codec = codec;
+	file->size = size;
+	file->synced = time( NULL );
+	file->next = table->buckets[bucket];
+	table->buckets[bucket] = file;
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file;
+}
+
+PgFuseFile *file_table_lookup( PgFileTable *table, const int64_t id )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return NULL;
+	}
+
+	for( file = table->buckets[id % FILE_TABLE_SIZE]; file != NULL; file = file->next ) {
+		if( file->id == id ) {
+			file->refcount++;
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file;
+}
+
+int file_table_close( PgFileTable *table, PgFuseFile *file )
+{
+	PgFuseFile **ptr;
+	int res;
+
+	res = pthread_mutex_lock( &table->lock );
+	if( res < 0 ) return res;
+
+	file->refcount--;
+	if( file->refcount > 0 ) {
+		(void)pthread_mutex_unlock( &table->lock );
+		return 0;
+	}
+
+	if( file->spool_fd >= 0 ) {
+		syslog( LOG_ERR, "Closing spooled file '%s' which has not been stored",
+			file->path );
+		ptr = &table->spooled;
+	} else {
+		ptr = &table->buckets[file->id % FILE_TABLE_SIZE];
+	}
+	for( ; *ptr != NULL; ptr = &(*ptr)->next ) {
+		if( *ptr == file ) {
+			*ptr = file->next;
+			break;
+		}
+	}
+
+	if( file->nof_dirty > 0 ) {
+		syslog( LOG_ERR, "Closing file with id '%"PRIi64"' with %zu unwritten dirty blocks",
+			file->id, file->nof_dirty );
+		table->dirty_bytes -= file->nof_dirty * table->block_size;
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	free_file( file );
+
+	return 0;
+}
+
+/* overlay the metadata read from the database with the size and the
+ * modification time of an open file which have not been written yet */
+void file_table_meta( PgFileTable *table, const int64_t id, PgMeta *meta )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return;
+	}
+
+	for( file = table->buckets[id % FILE_TABLE_SIZE]; file != NULL; file = file->next ) {
+		if( file->id == id ) {
+			if( file->meta_dirty ) {
+				meta->size = file->size;
+				meta->mtime = file->mtime;
+			}
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* an explicitly set modification time must not be overwritten by an older
+ * deferred one */
+void file_table_utime( PgFileTable *table, const int64_t id, const struct timespec mtime )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return;
+	}
+
+	for( file = table->buckets[id % FILE_TABLE_SIZE]; file != NULL; file = file->next ) {
+		if( file->id == id ) {
+			file->mtime = mtime;
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* the commit of a group transaction failed, remember the error for
+ * the open files which have been written in it */
+void file_table_fail( PgFileTable *table, const int64_t generation )
+{
+	PgFuseFile *file;
+	size_t i;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return;
+	}
+
+	for( i = 0; i < FILE_TABLE_SIZE; i++ ) {
+		for( file = table->buckets[i]; file != NULL; file = file->next ) {
+			if( file->generation == generation ) {
+				file->error = -EIO;
+			}
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* --- inode locks --- */
+
+/* changes of an inode, open or not, are serialized by the lock of its
+ * stripe, so concurrent writers of a file don't wait for each other's row
+ * locks in the database, or deadlock there. The lock of an open file is
+ * taken first, then the one of the inode, then a connection */
+
+void file_table_lock_id( PgFileTable *table, const int64_t id )
+{
+	(void)pthread_mutex_lock( &table->stripes[(uint64_t)id % FILE_LOCK_STRIPES] );
+}
+
+void file_table_unlock_id( PgFileTable *table, const int64_t id )
+{
+	(void)pthread_mutex_unlock( &table->stripes[(uint64_t)id % FILE_LOCK_STRIPES] );
+}
+
+/* a spooled file has no inode yet, it gets one while it's locked, so the
+ * stripe taken is remembered */
+void file_lock( PgFileTable *table, PgFuseFile *file )
+{
+	(void)pthread_mutex_lock( &file->lock );
+	file->stripe = NULL;
+	if( file->spool_fd < 0 ) {
+		file->stripe = &table->stripes[(uint64_t)file->id % FILE_LOCK_STRIPES];
+		(void)pthread_mutex_lock( file->stripe );
+	}
+}
+
+void file_unlock( PgFileTable *table, PgFuseFile *file )
+{
+	if( file->stripe != NULL ) {
+		(void)pthread_mutex_unlock( file->stripe );
+	}
+	(void)pthread_mutex_unlock( &file->lock );
+}
+
+/* --- spooled files --- */
+
+/* a new file is written to an anonymous file in 'dir' and stored in the
+ * database as a whole when it is closed, the file has id 0 till then */
+PgFuseFile *file_table_spool( PgFileTable *table, const char *dir, const char *path, const int64_t parent_id, const PgMeta meta )
+{
+	PgFuseFile *file;
+	char name[PATH_MAX];
+
+	file = (PgFuseFile *)calloc( 1, sizeof( PgFuseFile ) );
+	if( file == NULL ) {
+		return NULL;
+	}
+
+	file->path = strdup( path );
+	if( file->path == NULL ) {
+		free( file );
+		return NULL;
+	}
+
+	if( pthread_mutex_init( &file->lock, NULL ) < 0 ) {
+		free( file->path );
+		free( file );
+		return NULL;
+	}
+
+	file->block_size = table->block_size;
+	file->codec = meta.codec;
+
+	/* nobody else needs the name, no garbage is left after a crash */
+	(void)snprintf( name, sizeof( name ), "%s/pgfuse-XXXXXX", dir );
+	file->spool_fd = mkstemp( name );
+	if( file->spool_fd < 0 ) {
+		syslog( LOG_ERR, "Can't create spool file in '%s': %m", dir );
+		(void)pthread_mutex_destroy( &file->lock );
+		free( file->path );
+		free( file );
+		return NULL;
+	}
+	(void)unlink( name );
+
+	file->refcount = 1;
+	file->parent_id = parent_id;
+	file->meta = meta;
+	file->synced = time( NULL );
+
+	(void)pthread_mutex_lock( &table->lock );
+	file->next = table->spooled;
+	table->spooled = file;
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file;
+}
+
+PgFuseFile *file_table_lookup_spooled( PgFileTable *table, const char *path )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return NULL;
+	}
+
+	for( file = table->spooled; file != NULL; file = file->next ) {
+		if( strcmp( file->path, path ) == 0 ) {
+			file->refcount++;
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file;
+}
+
+/* a spooled file somewhere below the directory 'dir', referenced like
+ * by file_table_lookup_spooled, NULL if there is none */
+PgFuseFile *file_table_lookup_spooled_below( PgFileTable *table, const char *dir )
+{
+	PgFuseFile *file;
+	size_t len = strlen( dir );
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return NULL;
+	}
+
+	for( file = table->spooled; file != NULL; file = file->next ) {
+		if( strncmp( file->path, dir, len ) == 0 && file->path[len] == '/' ) {
+			file->refcount++;
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file;
+}
+
+/* whether the directory 'parent_id' has spooled files */
+int file_table_has_spooled( PgFileTable *table, const int64_t parent_id )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return 0;
+	}
+
+	for( file = table->spooled; file != NULL; file = file->next ) {
+		if( file->parent_id == parent_id ) {
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file != NULL;
+}
+
+/* metadata of a spooled file, returns 0 if 'path' is not spooled */
+int file_table_spooled_meta( PgFileTable *table, const char *path, PgMeta *meta )
+{
+	PgFuseFile *file;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return 0;
+	}
+
+	for( file = table->spooled; file != NULL; file = file->next ) {
+		if( strcmp( file->path, path ) == 0 ) {
+			*meta = file->meta;
+			meta->size = file->size;
+			meta->parent_id = file->parent_id;
+			break;
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return file != NULL;
+}
+
+/* add the spooled files of a directory to a directory listing */
+int file_table_readdir( PgFileTable *table, const int64_t parent_id, void *buf, fuse_fill_dir_t filler )
+{
+	PgFuseFile *file;
+	const char *name;
+
+	if( pthread_mutex_lock( &table->lock ) < 0 ) {
+		return -EIO;
+	}
+
+	for( file = table->spooled; file != NULL; file = file->next ) {
+		if( file->parent_id == parent_id ) {
+			name = strrchr( file->path, '/' );
+			filler( buf, name != NULL ? name + 1 : file->path, NULL, 0 );
+		}
+	}
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return 0;
+}
+
+int file_spool_write( PgFileTable *table, PgFuseFile *file, const char *buf, const off_t offset, const size_t len, const struct timespec mtime )
+{
+	ssize_t res;
+
+	res = pwrite( file->spool_fd, buf, len, offset );
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Writing to spool of file '%s' failed: %m", file->path );
+		return -EIO;
+	}
+
+	(void)pthread_mutex_lock( &table->lock );
+	if( offset + res > file->size ) {
+		file->size = offset + res;
+	}
+	file->meta.mtime = mtime;
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return res;
+}
+
+int file_spool_read( PgFileTable *table, PgFuseFile *file, char *buf, const off_t offset, const size_t len )
+{
+	ssize_t res;
+
+	res = pread( file->spool_fd, buf, len, offset );
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Reading from spool of file '%s' failed: %m", file->path );
+		return -EIO;
+	}
+
+	return res;
+}
+
+int file_spool_truncate( PgFileTable *table, PgFuseFile *file, const off_t size )
+{
+	if( ftruncate( file->spool_fd, size ) < 0 ) {
+		syslog( LOG_ERR, "Truncating spool of file '%s' failed: %m", file->path );
+		return -EIO;
+	}
+
+	(void)pthread_mutex_lock( &table->lock );
+	file->size = size;
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return 0;
+}
+
+/* the spooled file has been stored in the database as 'id', from now on
+ * it is an ordinary open file */
+void file_stored( PgFileTable *table, PgFuseFile *file, const int64_t id )
+{
+	PgFuseFile **ptr;
+
+	(void)pthread_mutex_lock( &table->lock );
+
+	for( ptr = &table->spooled; *ptr != NULL; ptr = &(*ptr)->next ) {
+		if( *ptr == file ) {
+			*ptr = file->next;
+			break;
+		}
+	}
+
+	(void)close( file->spool_fd );
+	file->spool_fd = -1;
+	free( file->path );
+	file->path = NULL;
+
+	file->id = id;
+	file->stored_size = file->size;
+	file->next = table->buckets[id % FILE_TABLE_SIZE];
+	table->buckets[id % FILE_TABLE_SIZE] = file;
+
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* --- write-back buffer --- */
+
+/* binary search for a dirty block, returns the index of the block or
+ * the position where it has to be inserted */
+static size_t find_block( PgFuseFile *file, const int64_t block_no )
+{
+	size_t low = 0;
+	size_t high = file->nof_dirty;
+	size_t mid;
+
+	/* sequential writes always hit the end of the buffer */
+	if( high > 0 && file->dirty[high - 1].block_no < block_no ) {
+		return high;
+	}
+
+	while( low < high ) {
+		mid = ( low + high ) / 2;
+		if( file->dirty[mid].block_no < block_no ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+static int reserve_blocks( PgFileTable *table, const size_t nof_blocks )
+{
+	int res;
+
+	if( nof_blocks == 0 ) return 1;
+
+	res = pthread_mutex_lock( &table->lock );
+	if( res < 0 ) return res;
+
+	if( table->dirty_bytes + nof_blocks * table->block_size > table->dirty_max ) {
+		(void)pthread_mutex_unlock( &table->lock );
+		return 0;
+	}
+
+	table->dirty_bytes += nof_blocks * table->block_size;
+
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return 1;
+}
+
+static void unreserve_blocks( PgFileTable *table, const size_t nof_blocks )
+{
+	if( nof_blocks == 0 ) return;
+
+	(void)pthread_mutex_lock( &table->lock );
+	table->dirty_bytes -= nof_blocks * table->block_size;
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* absorb a write into the buffer of dirty blocks. Returns the number of
+ * octets absorbed or 0 if the write doesn't fit into the buffer, either
+ * because of the dirty memory limit or because it would leave a hole in
+ * the dirty range of a block. The caller has to flush and retry then */
+int file_write( PgFileTable *table, PgFuseFile *file, const char *buf, const off_t offset, const size_t len )
+{
+	const size_t block_size = table->block_size;
+	int64_t block_no;
+	int64_t last_block;
+	size_t from;
+	size_t to;
+	size_t idx;
+	size_t nof_new;
+	const char *src;
+	PgDirtyBlock *block;
+	int res;
+
+	if( len == 0 ) return 0;
+
+	last_block = ( offset + len - 1 ) / block_size;
+
+	/* first pass: check whether the write can be absorbed completely */
+	nof_new = 0;
+	for( block_no = offset / block_size; block_no <= last_block; block_no++ ) {
+		from = ( block_no == offset / block_size ) ? offset % block_size : 0;
+		to = ( block_no == last_block ) ? ( offset + len - 1 ) % block_size + 1 : block_size;
+
+		idx = find_block( file, block_no );
+		if( idx < file->nof_dirty && file->dirty[idx].block_no == block_no ) {
+			block = &file->dirty[idx];
+			if( to < block->from || from > block->to ) {
+				return 0;
+			}
+		} else {
+			nof_new++;
+		}
+	}
+
+	res = reserve_blocks( table, nof_new );
+	if( res <= 0 ) {
+		return res;
+	}
+
+	if( file->nof_dirty + nof_new > file->max_dirty ) {
+		size_t max_dirty = file->max_dirty * 2;
+		PgDirtyBlock *dirty;
+
+		if( max_dirty < file->nof_dirty + nof_new ) {
+			max_dirty = file->nof_dirty + nof_new;
+		}
+		dirty = (PgDirtyBlock *)realloc( file->dirty, max_dirty * sizeof( PgDirtyBlock ) );
+		if( dirty == NULL ) {
+			unreserve_blocks( table, nof_new );
+			return -ENOMEM;
+		}
+		file->dirty = dirty;
+		file->max_dirty = max_dirty;
+	}
+
+	/* second pass: copy the data into the dirty blocks */
+	src = buf;
+	for( block_no = offset / block_size; block_no <= last_block; block_no++ ) {
+		from = ( block_no == offset / block_size ) ? offset % block_size : 0;
+		to = ( block_no == last_block ) ? ( offset + len - 1 ) % block_size + 1 : block_size;
+
+		idx = find_block( file, block_no );
+		if( idx < file->nof_dirty && file->dirty[idx].block_no == block_no ) {
+			block = &file->dirty[idx];
+			if( from < block->from ) block->from = from;
+			if( to > block->to ) block->to = to;
+		} else {
+			char *data = (char *)malloc( block_size );
+			if( data == NULL ) {
+				unreserve_blocks( table, nof_new );
+				return -ENOMEM;
+			}
+			nof_new--;
+			memmove( &file->dirty[idx + 1], &file->dirty[idx],
+				( file->nof_dirty - idx ) * sizeof( PgDirtyBlock ) );
+			file->nof_dirty++;
+			block = &file->dirty[idx];
+			block->block_no = block_no;
+			block->from = from;
+			block->to = to;
+			block->data = data;
+		}
+
+		memcpy( block->data + from, src, to - from );
+		src += to - from;
+	}
+
+	return len;
+}
+
+/* write all dirty blocks to the database. Dirty ranges touching at block
+ * boundaries are written together as one run, so sequential small writes
+ * end up as full blocks. The caller is responsible for the transaction
+ * and for discarding the buffer afterwards */
+int file_flush( PgFileTable *table, PgFuseFile *file, PGconn *conn, const char *path, int verbose )
+{
+	const size_t block_size = table->block_size;
+	PgDirtyBlock *dirty = file->dirty;
+	size_t i;
+	size_t j;
+	size_t k;
+	size_t len;
+	char *buf;
+	char *dst;
+	int res;
+	off_t offset;
+
+	i = 0;
+	while( i < file->nof_dirty ) {
+		j = i;
+		len = dirty[i].to - dirty[i].from;
+		while( j + 1 < file->nof_dirty &&
+			dirty[j].to == block_size &&
+			dirty[j + 1].block_no == dirty[j].block_no + 1 &&
+			dirty[j + 1].from == 0 ) {
+			j++;
+			len += dirty[j].to;
+		}
+
+		if( i == j ) {
+			buf = dirty[i].data + dirty[i].from;
+		} else {
+			buf = (char *)malloc( len );
+			if( buf == NULL ) {
+				return -ENOMEM;
+			}
+			dst = buf;
+			for( k = i; k <= j; k++ ) {
+				memcpy( dst, dirty[k].data + dirty[k].from, dirty[k].to - dirty[k].from );
+				dst += dirty[k].to - dirty[k].from;
+			}
+		}
+
+		if( verbose ) {
+			syslog( LOG_DEBUG, "Flushing %zu dirty blocks of file '%s' from block '%"PRIi64"', %zu octets",
+				j - i + 1, path, dirty[i].block_no, len );
+		}
+
+		offset = dirty[i].block_no * block_size + dirty[i].from;
+		res = psql_write_buf( conn, file->block_size, table->engine, file->id, file->lo_oid, file->codec, path, buf,
+			offset, len, file->stored_size, verbose );
+
+		if( i != j ) {
+			free( buf );
+		}
+
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != len ) {
+			syslog( LOG_ERR, "Flush size mismatch in file '%s', expected '%zu' to be written, but actually wrote '%d' bytes!",
+				path, len, res );
+			return -EIO;
+		}
+
+		if( offset + len > file->stored_size ) {
+			file->stored_size = offset + len;
+		}
+
+		i = j + 1;
+	}
+
+	return 0;
+}
+
+/* forget all dirty blocks */
+void file_discard( PgFileTable *table, PgFuseFile *file )
+{
+	size_t i;
+
+	for( i = 0; i < file->nof_dirty; i++ ) {
+		free( file->dirty[i].data );
+	}
+	unreserve_blocks( table, file->nof_dirty );
+	file->nof_dirty = 0;
+}
+
+/* --- deferred metadata --- */
+
+/* remember a write, size and modification time are written later */
+void file_extend( PgFileTable *table, PgFuseFile *file, const int64_t end, const struct timespec mtime )
+{
+	(void)pthread_mutex_lock( &table->lock );
+	if( end > file->size ) {
+		file->size = end;
+	}
+	file->mtime = mtime;
+	file->meta_dirty = 1;
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* the file has been truncated in the database */
+void file_truncate( PgFileTable *table, PgFuseFile *file, const int64_t size )
+{
+	(void)pthread_mutex_lock( &table->lock );
+	file->stored_size = size;
+	file->size = size;
+	file->meta_dirty = 0;
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* the file has been written in the group transaction 'generation' */
+void file_joined( PgFileTable *table, PgFuseFile *file, const int64_t generation )
+{
+	(void)pthread_mutex_lock( &table->lock );
+	file->generation = generation;
+	(void)pthread_mutex_unlock( &table->lock );
+}
+
+/* return and forget the error of a failed group commit */
+int file_error( PgFileTable *table, PgFuseFile *file )
+{
+	int res;
+
+	(void)pthread_mutex_lock( &table->lock );
+	res = file->error;
+	file->error = 0;
+	(void)pthread_mutex_unlock( &table->lock );
+
+	return res;
+}
+
+/* size and modification time have been written to the database */
+void file_synced( PgFileTable *table, PgFuseFile *file )
+{
+	(void)pthread_mutex_lock( &table->lock );
+	file->meta_dirty = 0;
+	(void)pthread_mutex_unlock( &table->lock );
+	file->synced = time( NULL );
+}
@@ -0,0 +1,155 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILE_H
+#define FILE_H
+
+#include <sys/types.h>		/* size_t, off_t */
+#include <sys/time.h>		/* for struct timespec */
+#include <stdint.h>		/* for int64_t */
+#include <time.h>		/* for time_t */
+
+#include <pthread.h>		/* for mutex */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include "pgsql.h"		/* for PgMeta */
+#include "config.h"		/* for FILE_LOCK_STRIPES */
+
+/* --- a block in the write-back buffer --- */
+
+typedef struct PgDirtyBlock {
+	int64_t block_no;	/* number of the block in the file */
+	size_t from;		/* offset of the first dirty octet in the block */
+	size_t to;		/* offset after the last dirty octet in the block */
+	char *data;		/* block_size octets, only [from,to) are valid */
+} PgDirtyBlock;
+
+/* --- an open file, shared by all handles of the same inode --- */
+
+typedef struct PgFuseFile {
+	int64_t id;		/* id/inode_no of the file */
+	int refcount;		/* number of handles and lookups referencing the file */
+	pthread_mutex_t lock;	/* serializes writes and flushes of the file */
+	pthread_mutex_t *stripe;	/* inode lock taken by file_lock, NULL if spooled */
+	PgDirtyBlock *dirty;	/* dirty blocks, ordered by block number */
+	size_t nof_dirty;	/* number of dirty blocks */
+	size_t max_dirty;	/* allocated size of the dirty array */
+	int64_t stored_size;	/* end of the data stored in the database */
+	size_t block_size;	/* block size of the file in the database */
+	Oid lo_oid;		/* large object of a huge file, InvalidOid otherwise */
+	int codec;		/* how the blocks of the file are stored */
+	int64_t size;		/* size of the file including unwritten data (*) */
+	struct timespec mtime;	/* modification time of the last write (*) */
+	int meta_dirty;		/* size and mtime still have to be written (*) */
+	time_t synced;		/* when data and metadata have been written last */
+	int64_t generation;	/* group transaction which wrote the file last (*) */
+	int error;		/* error of a group commit not reported yet (*) */
+	int spool_fd;		/* local spool of a file not in the database yet, -1 otherwise */
+	char *path;		/* path of a spooled file */
+	int64_t parent_id;	/* directory of a spooled file */
+	PgMeta meta;		/* metadata of a spooled file, size is in 'size' */
+	struct PgFuseFile *next;	/* next file in the same hash bucket */
+} PgFuseFile;
+
+/* (*) protected by the lock of the table, so they can be read without
+ * waiting for a flush of the file */
+
+/* --- table of all open files of the mount --- */
+
+typedef struct PgFileTable {
+	PgFuseFile **buckets;	/* hash of open files by id */
+	PgFuseFile *spooled;	/* open files which are not in the database yet */
+	size_t block_size;	/* block size of the filesystem */
+	int engine;		/* storage engine for flushed data */
+	size_t dirty_bytes;	/* memory used by dirty blocks of all files */
+	size_t dirty_max;	/* limit for dirty_bytes, 0 disables buffering */
+	pthread_mutex_t lock;	/* monitor lock */
+	pthread_mutex_t stripes[FILE_LOCK_STRIPES];	/* inode locks, by id */
+} PgFileTable;
+
+int file_table_init( PgFileTable *table, const size_t block_size, const int engine, const size_t dirty_max );
+
+int file_table_destroy( PgFileTable *table );
+
+PgFuseFile *file_table_open( PgFileTable *table, const int64_t id, const int64_t size, const size_t block_size, const Oid lo_oid, const int codec );
+
+PgFuseFile *file_table_lookup( PgFileTable *table, const int64_t id );
+
+int file_table_close( PgFileTable *table, PgFuseFile *file );
+
+void file_table_meta( PgFileTable *table, const int64_t id, PgMeta *meta );
+
+void file_table_utime( PgFileTable *table, const int64_t id, const struct timespec mtime );
+
+void file_table_fail( PgFileTable *table, const int64_t generation );
+
+/* --- inode locks, taken before a connection --- */
+
+void file_table_lock_id( PgFileTable *table, const int64_t id );
+
+void file_table_unlock_id( PgFileTable *table, const int64_t id );
+
+void file_lock( PgFileTable *table, PgFuseFile *file );
+
+void file_unlock( PgFileTable *table, PgFuseFile *file );
+
+/* --- files spooled locally until they are closed --- */
+
+PgFuseFile *file_table_spool( PgFileTable *table, const char *dir, const char *path, const int64_t parent_id, const PgMeta meta );
+
+PgFuseFile *file_table_lookup_spooled( PgFileTable *table, const char *path );
+
+PgFuseFile *file_table_lookup_spooled_below( PgFileTable *table, const char *dir );
+
+int file_table_has_spooled( PgFileTable *table, const int64_t parent_id );
+
+int file_table_spooled_meta( PgFileTable *table, const char *path, PgMeta *meta );
+
+int file_table_readdir( PgFileTable *table, const int64_t parent_id, void *buf, fuse_fill_dir_t filler );
+
+/* --- spooled data, the caller must hold the lock of the file --- */
+
+int file_spool_write( PgFileTable *table, PgFuseFile *file, const char *buf, const off_t offset, const size_t len, const struct timespec mtime );
+
+int file_spool_read( PgFileTable *table, PgFuseFile *file, char *buf, const off_t offset, const size_t len );
+
+int file_spool_truncate( PgFileTable *table, PgFuseFile *file, const off_t size );
+
+void file_stored( PgFileTable *table, PgFuseFile *file, const int64_t id );
+
+/* --- write-back buffer, the caller must hold the lock of the file --- */
+
+int file_write( PgFileTable *table, PgFuseFile *file, const char *buf, const off_t offset, const size_t len );
+
+int file_flush( PgFileTable *table, PgFuseFile *file, PGconn *conn, const char *path, int verbose );
+
+void file_discard( PgFileTable *table, PgFuseFile *file );
+
+/* --- deferred metadata, the caller must hold the lock of the file --- */
+
+void file_extend( PgFileTable *table, PgFuseFile *file, const int64_t end, const struct timespec mtime );
+
+void file_truncate( PgFileTable *table, PgFuseFile *file, const int64_t size );
+
+void file_synced( PgFileTable *table, PgFuseFile *file );
+
+void file_joined( PgFileTable *table, PgFuseFile *file, const int64_t generation );
+
+int file_error( PgFileTable *table, PgFuseFile *file );
+
+#endif
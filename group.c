@@ -0,0 +1,286 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "group.h"
+
+#include <string.h>		/* for strcmp */
+#include <errno.h>		/* for ENOENT and friends */
+#include <syslog.h>		/* for syslog */
+#include <inttypes.h>		/* for PRIxxx macros */
+#include <time.h>		/* for clock_gettime */
+
+#include "pgsql.h"		/* for psql_set_async_commit, psql_sync */
+
+/* operations share one transaction, each of them runs in a savepoint, so
+ * a failing operation doesn't abort the operations before it */
+
+static int exec_command( PGconn *conn, const char *sql )
+{
+	PGresult *res;
+	
+	res = PQexec( conn, sql );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "'%s' failed in group commit: %s", sql, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+/* commit the open transaction, the caller must hold the lock */
+static int commit_group( PgGroup *group )
+{
+	PGresult *res;
+	int64_t generation;
+	int ok;
+
+	if( !group->in_transaction ) {
+		return 0;
+	}
+
+	generation = group->generation;
+	group->generation++;
+	group->in_transaction = 0;
+	group->nof_ops = 0;
+
+	/* COMMIT of an aborted transaction succeeds with a ROLLBACK */
+	res = PQexec( group->conn, "COMMIT" );
+	ok = ( PQresultStatus( res ) == PGRES_COMMAND_OK && strcmp( PQcmdStatus( res ), "COMMIT" ) == 0 );
+	PQclear( res );
+
+	if( !ok ) {
+		syslog( LOG_ERR, "Commit of group transaction %"PRIi64" failed: %s",
+			generation, PQerrorMessage( group->conn ) );
+		if( group->failed != NULL ) {
+			group->failed( group->ctx, generation );
+		}
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void add_milliseconds( struct timespec *t, const unsigned int ms )
+{
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += ( ms % 1000 ) * 1000000L;
+	if( t->tv_nsec >= 1000000000L ) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+/* commits transactions after max_delay, also when no operation follows */
+static void *commit_thread( void *arg )
+{
+	PgGroup *group = (PgGroup *)arg;
+	struct timespec deadline;
+	struct timespec t;
+
+	(void)pthread_mutex_lock( &group->lock );
+
+	while( !group->stop ) {
+		if( !group->in_transaction ) {
+			(void)pthread_cond_wait( &group->cond, &group->lock );
+			continue;
+		}
+
+		deadline = group->started;
+		add_milliseconds( &deadline, group->max_delay );
+
+		(void)clock_gettime( CLOCK_REALTIME, &t );
+		if( t.tv_sec > deadline.tv_sec ||
+			( t.tv_sec == deadline.tv_sec && t.tv_nsec >= deadline.tv_nsec ) ) {
+			(void)commit_group( group );
+			continue;
+		}
+
+		(void)pthread_cond_timedwait( &group->cond, &group->lock, &deadline );
+	}
+
+	(void)pthread_mutex_unlock( &group->lock );
+
+	return NULL;
+}
+
+int group_init( PgGroup *group, const char *conninfo, const size_t max_ops, const unsigned int max_delay, const int async_commit, PgGroupFailed failed, void *ctx )
+{
+	int res;
+
+	memset( group, 0, sizeof( PgGroup ) );
+	group->max_ops = max_ops;
+	group->max_delay = max_delay;
+	group->async_commit = async_commit;
+	group->failed = failed;
+	group->ctx = ctx;
+	group->generation = 1;
+
+	group->conn = PQconnectdb( conninfo );
+	if( PQstatus( group->conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database failed: %s",
+			PQerrorMessage( group->conn ) );
+		PQfinish( group->conn );
+		return -EIO;
+	}
+
+	if( async_commit && psql_set_async_commit( group->conn ) < 0 ) {
+		PQfinish( group->conn );
+		return -EIO;
+	}
+
+	res = pthread_mutex_init( &group->lock, NULL );
+	if( res != 0 ) {
+		PQfinish( group->conn );
+		return -res;
+	}
+
+	res = pthread_cond_init( &group->cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &group->lock );
+		PQfinish( group->conn );
+		return -res;
+	}
+
+	res = pthread_create( &group->thread, NULL, commit_thread, group );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &group->cond );
+		(void)pthread_mutex_destroy( &group->lock );
+		PQfinish( group->conn );
+		return -res;
+	}
+
+	return 0;
+}
+
+int group_destroy( PgGroup *group )
+{
+	int res;
+
+	(void)pthread_mutex_lock( &group->lock );
+	group->stop = 1;
+	(void)pthread_cond_signal( &group->cond );
+	(void)pthread_mutex_unlock( &group->lock );
+
+	(void)pthread_join( group->thread, NULL );
+
+	/* the last operations are committed on unmount */
+	res = commit_group( group );
+
+	PQfinish( group->conn );
+
+	(void)pthread_cond_destroy( &group->cond );
+	(void)pthread_mutex_destroy( &group->lock );
+
+	return res;
+}
+
+/* operations use the connection one after the other */
+PGconn *group_acquire( PgGroup *group )
+{
+	int res;
+
+	res = pthread_mutex_lock( &group->lock );
+	if( res != 0 ) {
+		syslog( LOG_ERR, "Locking mutex failed for thread '%u': %d",
+			(unsigned int)pthread_self( ), res );
+		return NULL;
+	}
+
+	return group->conn;
+}
+
+int group_release( PgGroup *group, PGconn *conn )
+{
+	int res = 0;
+
+	if( group->nof_ops >= group->max_ops ) {
+		res = commit_group( group );
+	}
+
+	(void)pthread_mutex_unlock( &group->lock );
+
+	return res;
+}
+
+int group_begin( PgGroup *group, PGconn *conn )
+{
+	if( group->in_transaction ) {
+		return exec_command( conn, "SAVEPOINT op" );
+	}
+
+	if( exec_command( conn, "BEGIN; SAVEPOINT op" ) < 0 ) {
+		return -EIO;
+	}
+
+	group->in_transaction = 1;
+	(void)clock_gettime( CLOCK_REALTIME, &group->started );
+	(void)pthread_cond_signal( &group->cond );
+
+	return 0;
+}
+
+int group_commit( PgGroup *group, PGconn *conn )
+{
+	group->nof_ops++;
+
+	return exec_command( conn, "RELEASE SAVEPOINT op" );
+}
+
+/* as group_commit, the transaction is committed right away, for
+ * operations which can't report a failed commit later */
+int group_commit_now( PgGroup *group, PGconn *conn )
+{
+	int res;
+
+	res = group_commit( group, conn );
+	if( res < 0 ) {
+		return res;
+	}
+
+	return commit_group( group );
+}
+
+int group_rollback( PgGroup *group, PGconn *conn )
+{
+	return exec_command( conn, "ROLLBACK TO SAVEPOINT op; RELEASE SAVEPOINT op" );
+}
+
+int64_t group_generation( PgGroup *group )
+{
+	return group->generation;
+}
+
+/* commit now and wait until everything committed before is durable */
+int group_sync( PgGroup *group, PGconn *conn )
+{
+	int res;
+
+	res = commit_group( group );
+	if( res < 0 ) {
+		return res;
+	}
+
+	if( group->async_commit ) {
+		return psql_sync( conn );
+	}
+
+	return 0;
+}
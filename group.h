@@ -0,0 +1,71 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <sys/types.h>		/* size_t */
+#include <sys/time.h>		/* for struct timespec */
+#include <stdint.h>		/* for int64_t */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <pthread.h>		/* for mutex and conditionals */
+
+/* called after the commit of a transaction failed */
+typedef void (*PgGroupFailed)( void *ctx, const int64_t generation );
+
+typedef struct PgGroup {
+	PGconn *conn;		/* connection shared by all operations */
+	size_t max_ops;		/* commit after that many operations */
+	unsigned int max_delay;	/* commit after that many milliseconds */
+	int async_commit;	/* whether we commit asynchronously */
+	int in_transaction;	/* whether a transaction is open */
+	size_t nof_ops;		/* operations in the open transaction */
+	int64_t generation;	/* number of the open or the next transaction */
+	struct timespec started;	/* when the open transaction has begun */
+	PgGroupFailed failed;	/* called after a failed commit */
+	void *ctx;		/* context passed to failed */
+	int stop;		/* tells the commit thread to terminate */
+	pthread_t thread;	/* commits transactions open for too long */
+	pthread_mutex_t lock;	/* held by the operation using the connection */
+	pthread_cond_t cond;	/* signals a new transaction or termination */
+} PgGroup;
+
+int group_init( PgGroup *group, const char *conninfo, const size_t max_ops, const unsigned int max_delay, const int async_commit, PgGroupFailed failed, void *ctx );
+
+int group_destroy( PgGroup *group );
+
+PGconn *group_acquire( PgGroup *group );
+
+int group_release( PgGroup *group, PGconn *conn );
+
+/* --- operations, the caller must have acquired the connection --- */
+
+int group_begin( PgGroup *group, PGconn *conn );
+
+int group_commit( PgGroup *group, PGconn *conn );
+
+int group_commit_now( PgGroup *group, PGconn *conn );
+
+int group_rollback( PgGroup *group, PGconn *conn );
+
+int64_t group_generation( PgGroup *group );
+
+int group_sync( PgGroup *group, PGconn *conn );
+
+#endif
@@ -0,0 +1,27 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash.h"
+
+#include <openssl/sha.h>	/* for SHA256 */
+
+/* SHA-256 from libcrypto, which libpq links anyway. Equal hashes are
+ * taken as equal data, so the hash must resist collisions */
+void hash_block( const char *buf, const size_t len, unsigned char *hash )
+{
+	(void)SHA256( (const unsigned char *)buf, len, hash );
+}
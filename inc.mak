@@ -26,4 +26,4 @@ CFLAGS += `getconf LFS_CFLAGS`
 # release
 # use pkg-config to detemine compiler/linker flags for libfuse
 CFLAGS += `pkg-config fuse --cflags`
-LDFLAGS = `pkg-config fuse --libs` -lpq -pthread
+LDFLAGS = `pkg-config fuse --libs` -lpq -lcrypto -pthread
@@ -0,0 +1,41 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IOCTL_H
+#define IOCTL_H
+
+#include <sys/ioctl.h>		/* for _IOW */
+#include <limits.h>		/* for PATH_MAX */
+
+/* --- ioctls on open files and directories of a mount, used by pgclone --- */
+
+typedef struct PgFuseClone {
+	char path[PATH_MAX];	/* path in the mount starting with '/' */
+	int flags;		/* PGFUSE_CLONE_XXX */
+} PgFuseClone;
+
+#define PGFUSE_CLONE_SNAPSHOT	1	/* the clone of a tree is not writable */
+
+/* replace the data of the open file by the one of the file 'path' of the
+ * mount, the data is copied on the server */
+#define PGFUSE_IOC_CLONE	_IOW( 'P', 1, PgFuseClone )
+
+/* create 'path' as a clone of the open directory or file and everything
+ * below it, the clone shares the blocks until they are written */
+#define PGFUSE_IOC_CLONE_TREE	_IOW( 'P', 2, PgFuseClone )
+
+#endif
@@ -0,0 +1,227 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* pgclone: copy a file inside a pgfuse mount on the database server */
+
+#include <stdio.h>		/* for fprintf */
+#include <stdlib.h>		/* for realpath, EXIT_SUCCESS, EXIT_FAILURE */
+#include <string.h>		/* for strcpy, strlen, strerror, memset */
+#include <errno.h>		/* for errno */
+#include <unistd.h>		/* for close, getopt */
+#include <fcntl.h>		/* for open */
+#include <libgen.h>		/* for POSIX compliant dirname, basename */
+#include <limits.h>		/* for PATH_MAX */
+#include <sys/types.h>		/* for dev_t */
+#include <sys/stat.h>		/* for stat */
+
+#include "ioctl.h"		/* for PGFUSE_IOC_CLONE */
+
+/* the path of 'abs' inside the mount it is on, found by walking up the
+ * directories as long as they are on the same device */
+static int path_in_mount( const char *abs, const dev_t dev, char *path )
+{
+	char root[PATH_MAX];
+	char parent[PATH_MAX];
+	char *dir;
+	struct stat st;
+
+	strcpy( root, abs );
+	while( strcmp( root, "/" ) != 0 ) {
+		strcpy( parent, root );
+		dir = dirname( parent );
+		if( stat( dir, &st ) < 0 ) {
+			return -1;
+		}
+		if( st.st_dev != dev ) {
+			break;
+		}
+		strcpy( root, dir );
+	}
+
+	if( strcmp( root, "/" ) == 0 ) {
+		strcpy( path, abs );
+	} else if( abs[strlen( root )] == '\0' ) {
+		strcpy( path, "/" );
+	} else {
+		strcpy( path, abs + strlen( root ) );
+	}
+
+	return 0;
+}
+
+/* copy the file 'abs' into the file 'to', which is created if needed */
+static int clone_file( const char *abs, const struct stat *from_st, const char *to )
+{
+	PgFuseClone clone;
+	struct stat to_st;
+	int fd;
+
+	memset( &clone, 0, sizeof( clone ) );
+	if( path_in_mount( abs, from_st->st_dev, clone.path ) < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", abs, strerror( errno ) );
+		return -1;
+	}
+
+	fd = open( to, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+	if( fd < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( errno ) );
+		return -1;
+	}
+
+	if( fstat( fd, &to_st ) < 0 || to_st.st_dev != from_st->st_dev ) {
+		fprintf( stderr, "pgclone: %s and %s are not on the same pgfuse mount\n", abs, to );
+		(void)close( fd );
+		return -1;
+	}
+
+	if( ioctl( fd, PGFUSE_IOC_CLONE, &clone ) < 0 ) {
+		fprintf( stderr, "pgclone: cloning %s into %s: %s\n", abs, to, strerror( errno ) );
+		(void)close( fd );
+		return -1;
+	}
+
+	if( close( fd ) < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( errno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+/* clone the tree 'abs' as 'to', which must not exist */
+static int clone_tree( const char *abs, const struct stat *from_st, const char *to, const int flags )
+{
+	PgFuseClone clone;
+	char parent[PATH_MAX];
+	char parent_abs[PATH_MAX];
+	char name[PATH_MAX];
+	struct stat parent_st;
+	int fd;
+
+	if( snprintf( parent, sizeof( parent ), "%s", to ) >= (int)sizeof( parent ) ||
+		snprintf( name, sizeof( name ), "%s", to ) >= (int)sizeof( name ) ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( ENAMETOOLONG ) );
+		return -1;
+	}
+	if( realpath( dirname( parent ), parent_abs ) == NULL || stat( parent_abs, &parent_st ) < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( errno ) );
+		return -1;
+	}
+
+	if( parent_st.st_dev != from_st->st_dev ) {
+		fprintf( stderr, "pgclone: %s and %s are not on the same pgfuse mount\n", abs, to );
+		return -1;
+	}
+
+	memset( &clone, 0, sizeof( clone ) );
+	clone.flags = flags;
+	if( path_in_mount( parent_abs, from_st->st_dev, parent ) < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( errno ) );
+		return -1;
+	}
+	if( snprintf( clone.path, sizeof( clone.path ), "%s/%s", strcmp( parent, "/" ) == 0 ? "" : parent,
+		basename( name ) ) >= (int)sizeof( clone.path ) ) {
+		fprintf( stderr, "pgclone: %s: %s\n", to, strerror( ENAMETOOLONG ) );
+		return -1;
+	}
+
+	fd = open( abs, O_RDONLY );
+	if( fd < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", abs, strerror( errno ) );
+		return -1;
+	}
+
+	if( ioctl( fd, PGFUSE_IOC_CLONE_TREE, &clone ) < 0 ) {
+		fprintf( stderr, "pgclone: cloning %s as %s: %s\n", abs, to, strerror( errno ) );
+		(void)close( fd );
+		return -1;
+	}
+
+	(void)close( fd );
+
+	return 0;
+}
+
+static void print_usage( void )
+{
+	fprintf( stderr, "usage: pgclone [-r|-s] <source> <destination>\n\n"
+		"Copies a file inside a pgfuse mount on the database server\n\n"
+		"  -r  clone a directory and everything below it, the clone\n"
+		"      shares the blocks until they are written\n"
+		"  -s  like -r, the clone is a snapshot without write permissions\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+	char abs[PATH_MAX];
+	char to[PATH_MAX];
+	char name[PATH_MAX];
+	struct stat from_st;
+	struct stat to_st;
+	int tree = 0;
+	int flags = 0;
+	int opt;
+	int res;
+
+	while( ( opt = getopt( argc, argv, "rs" ) ) != -1 ) {
+		switch( opt ) {
+			case 'r':
+				tree = 1;
+				break;
+			case 's':
+				tree = 1;
+				flags |= PGFUSE_CLONE_SNAPSHOT;
+				break;
+			default:
+				print_usage( );
+				return EXIT_FAILURE;
+		}
+	}
+
+	if( argc - optind != 2 ) {
+		print_usage( );
+		return EXIT_FAILURE;
+	}
+
+	if( realpath( argv[optind], abs ) == NULL || stat( abs, &from_st ) < 0 ) {
+		fprintf( stderr, "pgclone: %s: %s\n", argv[optind], strerror( errno ) );
+		return EXIT_FAILURE;
+	}
+
+	/* like cp, a directory as destination gets an entry of the same name */
+	if( stat( argv[optind + 1], &to_st ) == 0 && S_ISDIR( to_st.st_mode ) ) {
+		(void)snprintf( name, sizeof( name ), "%s", abs );
+		if( snprintf( to, sizeof( to ), "%s/%s", argv[optind + 1], basename( name ) ) >= (int)sizeof( to ) ) {
+			fprintf( stderr, "pgclone: %s: %s\n", argv[optind + 1], strerror( ENAMETOOLONG ) );
+			return EXIT_FAILURE;
+		}
+	} else if( snprintf( to, sizeof( to ), "%s", argv[optind + 1] ) >= (int)sizeof( to ) ) {
+		fprintf( stderr, "pgclone: %s: %s\n", argv[optind + 1], strerror( ENAMETOOLONG ) );
+		return EXIT_FAILURE;
+	}
+
+	if( tree ) {
+		res = clone_tree( abs, &from_st, to, flags );
+	} else if( S_ISDIR( from_st.st_mode ) ) {
+		fprintf( stderr, "pgclone: %s is a directory, use -r\n", argv[optind] );
+		res = -1;
+	} else {
+		res = clone_file( abs, &from_st, to );
+	}
+
+	return ( res < 0 ) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -37,6 +37,10 @@
 
 #include <pthread.h>		/* for pthread_self */
 
+#if FUSE_VERSION >= 29
+#include <linux/falloc.h>	/* for FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE */
+#endif
+
 #if FUSE_VERSION < 21
 #error Currently only written for newer FUSE API (FUSE_VERSION at least 21)
 #endif
@@ -44,6 +48,11 @@
 #include "config.h"		/* compiled in defaults */
 #include "pgsql.h"		/* implements Postgresql accessers */
 #include "pool.h"		/* implements the connection pool */
+#include "file.h"		/* implements open files and write-back buffers */
+#include "group.h"		/* implements group commits for bulk loads */
+#include "compact.h"		/* compaction of the log engine */
+#include "reap.h"		/* deletion of unlinked files */
+#include "ioctl.h"		/* ioctls for the tools */
 
 /* --- FUSE private context data --- */
 
@@ -56,6 +65,21 @@ typedef struct PgFuseData {
 	int read_only;		/* whether the mount point is read-only */
 	int multi_threaded;	/* whether we run multi-threaded */
 	size_t block_size;	/* block size to use for storage of data in bytea fields */
+	size_t write_buffer;	/* size of the write-back buffer of all open files */
+	int async_commit;	/* whether only fsync waits for durable commits */
+	size_t bulkload;	/* operations per group transaction, 0 disables it */
+	unsigned int bulkdelay;	/* milliseconds after which a group transaction commits */
+	PgGroup group;		/* the group transaction (bulkload only) */
+	char *spool;		/* directory to spool new files in, NULL disables it */
+	size_t spool_max;	/* size up to which new files are spooled */
+	unsigned int parallel;	/* connections a big write is spread over, 0 or 1 disables it */
+	int engine;		/* storage engine of the file data */
+	size_t lo_threshold;	/* size from which files are large objects, 0 disables it */
+	int compress;		/* whether blocks of new files are compressed */
+	int dedup;		/* whether blocks of new files are deduplicated */
+	PgCompactor compactor;	/* folds extents into blocks (log engine only) */
+	PgReaper reaper;	/* deletes the data of unlinked files (read-write only) */
+	PgFileTable files;	/* open files and their dirty blocks */
 } PgFuseData;
 
 /* --- timestamp helpers --- */
@@ -84,6 +108,10 @@ static struct timespec now( void )
 
 static PGconn *psql_acquire( PgFuseData *data )
 {
+	if( data->bulkload > 0 ) {
+		return group_acquire( &data->group );
+	}
+	
 	if( !data->multi_threaded ) {
 		return data->conn;
 	}
@@ -93,6 +121,11 @@ static PGconn *psql_acquire( PgFuseData *data )
 
 static int psql_release( PgFuseData *data, PGconn *conn )
 {
+	/* don't hand on a pipeline left open by an early return */
+	(void)psql_pipeline_end( conn );
+	
+	if( data->bulkload > 0 ) return group_release( &data->group, conn );
+	
 	if( !data->multi_threaded ) return 0;
 	
 	return psql_pool_release( &data->pool, conn );
@@ -105,8 +138,437 @@ static int psql_release( PgFuseData *data, PGconn *conn )
 #define RELEASE( C ) \
 	if( psql_release( data, C ) < 0 ) return -EIO;
 
+/* --- transaction management and policies --- */
+
+/* in bulkload mode operations are savepoints in a shared transaction,
+ * the connection is released when the transaction management fails, as
+ * the RELEASE following the macros is skipped */
+
+static int psql_op_begin( PgFuseData *data, PGconn *conn )
+{
+	if( data->bulkload > 0 ) {
+		return group_begin( &data->group, conn );
+	}
+	
+	return psql_begin( conn );
+}
+
+static int psql_op_commit( PgFuseData *data, PGconn *conn )
+{
+	if( data->bulkload > 0 ) {
+		return group_commit( &data->group, conn );
+	}
+	
+	return psql_commit( conn );
+}
+
+/* an operation which changes the database but no open file can't report
+ * a failed group commit later, it returns after the commit of the group */
+static int psql_op_commit_now( PgFuseData *data, PGconn *conn )
+{
+	if( data->bulkload > 0 ) {
+		return group_commit_now( &data->group, conn );
+	}
+	
+	return psql_commit( conn );
+}
+
+static int psql_op_rollback( PgFuseData *data, PGconn *conn )
+{
+	if( data->bulkload > 0 ) {
+		return group_rollback( &data->group, conn );
+	}
+	
+	return psql_rollback( conn );
+}
+
+#define PSQL_BEGIN( T ) \
+	{ \
+		int __res; \
+		__res = psql_op_begin( data, T ); \
+		if( __res < 0 ) { \
+			(void)psql_release( data, T ); \
+			return __res; \
+		} \
+	}
+
+#define PSQL_COMMIT( T ) \
+	{ \
+		int __res; \
+		__res = psql_op_commit( data, T ); \
+		if( __res < 0 ) { \
+			(void)psql_release( data, T ); \
+			return __res; \
+		} \
+	}
+
+#define PSQL_COMMIT_NOW( T ) \
+	{ \
+		int __res; \
+		__res = psql_op_commit_now( data, T ); \
+		if( __res < 0 ) { \
+			(void)psql_release( data, T ); \
+			return __res; \
+		} \
+	}
+
+#define PSQL_ROLLBACK( T ) \
+	{ \
+		int __res; \
+		__res = psql_op_rollback( data, T ); \
+		if( __res < 0 ) { \
+			(void)psql_release( data, T ); \
+			return __res; \
+		} \
+	}
+
+/* the write statements of an operation are sent back to back, their
+ * results are checked by psql_pipeline_end. Not with bulkload, as the
+ * group transaction uses multi-statement commands, and not for framed or
+ * dedup files, as their writes depend on what is stored already */
+static void pipeline_begin( PgFuseData *data, PgFuseFile *f, PGconn *conn )
+{
+	if( data->bulkload == 0 && f->codec == PSQL_CODEC_NONE ) {
+		(void)psql_pipeline_begin( conn );
+	}
+}
+
 #define THREAD_ID (unsigned int)pthread_self( )
 
+/* --- retry of aborted transactions --- */
+
+/* an operation aborted by a deadlock or a serialization failure is
+ * repeated after a pause, doubled with every attempt, with some jitter so
+ * the contenders don't meet again. Not in bulkload mode, as the group
+ * transaction keeps the locks of the operations before */
+static int retry_op( PgFuseData *data, const int res, unsigned int *attempt )
+{
+	unsigned int ms;
+
+	if( res != -EAGAIN || data->bulkload > 0 || *attempt >= RETRY_MAX_ATTEMPTS ) {
+		return 0;
+	}
+
+	ms = RETRY_PAUSE << *attempt;
+	ms += (unsigned int)random( ) % ms;
+	(*attempt)++;
+
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Repeating aborted transaction in %u ms (attempt %u), thread #%u",
+			ms, *attempt, THREAD_ID );
+	}
+
+	(void)usleep( ms * 1000 );
+
+	return 1;
+}
+
+/* --- open file helpers --- */
+
+#define FILE_OF( fi ) ( (PgFuseFile *)(uintptr_t)( fi )->fh )
+
+/* remember the group transaction an open file has been written in */
+static void joined_group( PgFuseData *data, PgFuseFile *f )
+{
+	if( data->bulkload > 0 ) {
+		file_joined( &data->files, f, group_generation( &data->group ) );
+	}
+}
+
+static void group_failed( void *ctx, const int64_t generation )
+{
+	PgFuseData *data = (PgFuseData *)ctx;
+
+	file_table_fail( &data->files, generation );
+}
+
+/* write the dirty blocks of an open file and the deferred size and
+ * modification time, the caller must hold the lock of the file and run
+ * a transaction. The write-back buffer is kept */
+static int store_dirty( PgFuseData *data, PgFuseFile *f, PGconn *conn, const char *path )
+{
+	int res;
+
+	res = file_flush( &data->files, f, conn, path, data->verbose );
+	if( res < 0 ) {
+		return res;
+	}
+
+	if( !f->meta_dirty ) {
+		return 0;
+	}
+
+	return psql_write_size( conn, f->id, path, f->size, f->mtime );
+}
+
+static int write_back( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	pipeline_begin( data, f, conn );
+	PSQL_BEGIN( conn );
+
+	res = store_dirty( data, f, conn, path );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn );
+	res = psql_pipeline_end( conn );
+	if( res < 0 ) {
+		RELEASE( conn );
+		return res;
+	}
+	joined_group( data, f );
+	RELEASE( conn );
+
+	return 0;
+}
+
+/* write the dirty blocks and the metadata of an open file in one
+ * transaction, the caller must hold the lock of the file. The write-back
+ * buffer is empty afterwards. After an error it's kept, so the next
+ * flush writes it again and reports the error again if it persists */
+static int flush_file( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int64_t stored_size = f->stored_size;
+	unsigned int attempt = 0;
+	int res;
+
+	if( f->nof_dirty == 0 && !f->meta_dirty ) {
+		return 0;
+	}
+
+	/* the buffer is written again after an aborted transaction */
+	do {
+		f->stored_size = stored_size;
+		res = write_back( data, f, path );
+	} while( retry_op( data, res, &attempt ) );
+
+	if( res < 0 ) {
+		f->stored_size = stored_size;
+		return res;
+	}
+
+	file_discard( &data->files, f );
+
+	file_synced( &data->files, f );
+
+	return 0;
+}
+
+static int flush_file_locked( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+
+	file_lock( &data->files, f );
+	res = flush_file( data, f, path );
+	file_unlock( &data->files, f );
+
+	return res;
+}
+
+/* wait until all asynchronously committed transactions are durable, with
+ * bulkload commit the group transaction first */
+static int sync_commits( PgFuseData *data )
+{
+	int res;
+	PGconn *conn;
+
+	if( data->bulkload > 0 ) {
+		ACQUIRE( conn );
+		res = group_sync( &data->group, conn );
+		RELEASE( conn );
+		return res;
+	}
+
+	if( !data->async_commit ) {
+		return 0;
+	}
+
+	ACQUIRE( conn );
+	res = psql_sync( conn );
+	RELEASE( conn );
+
+	return res;
+}
+
+/* store a spooled file and its data in the database in one transaction,
+ * the caller must hold the lock of the file */
+static int store_spooled( PgFuseData *data, PgFuseFile *f )
+{
+	int64_t id;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+	char *buf;
+	char *copy_path;
+	size_t block_size;
+
+	if( f->spool_fd < 0 ) {
+		return 0;
+	}
+
+	meta = f->meta;
+	meta.size = f->size;
+
+	buf = (char *)malloc( meta.size + 1 );
+	copy_path = strdup( f->path );
+	if( buf == NULL || copy_path == NULL ) {
+		syslog( LOG_ERR, "Out of memory storing spooled file '%s'!", f->path );
+		free( buf );
+		free( copy_path );
+		return -ENOMEM;
+	}
+
+	res = file_spool_read( &data->files, f, buf, 0, meta.size );
+	if( res != meta.size ) {
+		free( buf );
+		free( copy_path );
+		return ( res < 0 ) ? res : -EIO;
+	}
+
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Storing spooled file '%s' of size %"PRIi64", thread #%u",
+			f->path, meta.size, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_create_file( conn, f->parent_id, f->path, basename( copy_path ), meta );
+	if( id < 0 ) {
+		free( buf );
+		free( copy_path );
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	/* the whole file is known, so is its block size */
+	block_size = psql_next_block_size( data->block_size, 0, meta.size );
+	if( block_size != data->block_size ) {
+		res = psql_write_block_size( conn, id, f->path, block_size );
+		if( res < 0 ) {
+			free( buf );
+			free( copy_path );
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+	}
+
+	if( meta.size > 0 ) {
+		res = psql_write_buf( conn, block_size, data->engine, id, InvalidOid, meta.codec, f->path, buf, 0, meta.size, 0, data->verbose );
+		if( res != meta.size ) {
+			free( buf );
+			free( copy_path );
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return ( res < 0 ) ? res : -EIO;
+		}
+	}
+
+	free( buf );
+	free( copy_path );
+
+	PSQL_COMMIT( conn );
+	joined_group( data, f );
+	RELEASE( conn );
+
+	file_stored( &data->files, f, id );
+	f->block_size = block_size;
+
+	return 0;
+}
+
+/* store a spooled file and write the dirty blocks of an open file */
+static int store_file_locked( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+
+	file_lock( &data->files, f );
+	res = store_spooled( data, f );
+	if( res == 0 ) {
+		res = flush_file( data, f, path );
+	}
+	file_unlock( &data->files, f );
+
+	return res;
+}
+
+/* operations on paths work on the database only, a spooled file with
+ * that path has to be stored first */
+static int store_spooled_path( PgFuseData *data, const char *path )
+{
+	int res;
+	PgFuseFile *f;
+
+	if( data->spool == NULL ) {
+		return 0;
+	}
+
+	f = file_table_lookup_spooled( &data->files, path );
+	if( f == NULL ) {
+		return 0;
+	}
+
+	file_lock( &data->files, f );
+	res = store_spooled( data, f );
+	file_unlock( &data->files, f );
+	(void)file_table_close( &data->files, f );
+
+	return res;
+}
+
+/* a directory changed by path takes the paths of the spooled files below
+ * it along, they are stored first */
+static int store_spooled_below( PgFuseData *data, const char *dir )
+{
+	int res;
+	PgFuseFile *f;
+
+	if( data->spool == NULL ) {
+		return 0;
+	}
+
+	while( ( f = file_table_lookup_spooled_below( &data->files, dir ) ) != NULL ) {
+		file_lock( &data->files, f );
+		res = store_spooled( data, f );
+		file_unlock( &data->files, f );
+		(void)file_table_close( &data->files, f );
+		if( res < 0 ) {
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+/* attributes of a spooled file, returns 0 if 'path' is not spooled */
+static int stat_spooled( PgFuseData *data, const char *path, struct stat *stbuf )
+{
+	PgMeta meta;
+
+	if( data->spool == NULL || !file_table_spooled_meta( &data->files, path, &meta ) ) {
+		return 0;
+	}
+
+	memset( stbuf, 0, sizeof( struct stat ) );
+	stbuf->st_mode = meta.mode;
+	stbuf->st_size = meta.size;
+	stbuf->st_blksize = data->block_size;
+	stbuf->st_blocks = ( meta.size + data->block_size - 1 ) / data->block_size;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = meta.uid;
+	stbuf->st_gid = meta.gid;
+	stbuf->st_atime = meta.atime.tv_sec;
+	stbuf->st_mtime = meta.mtime.tv_sec;
+	stbuf->st_ctime = meta.ctime.tv_sec;
+
+	return 1;
+}
+
 /* --- implementation of FUSE hooks --- */
 
 static void *pgfuse_init( struct fuse_conn_info *conn )
@@ -118,8 +580,23 @@ static void *pgfuse_init( struct fuse_conn_info *conn )
 		data->read_only ? "read-only" : "read-write",
 		THREAD_ID );
 	
-	/* in single-threaded case we just need one shared PostgreSQL connection */
-	if( !data->multi_threaded ) {
+	if( file_table_init( &data->files, data->block_size, data->engine, data->write_buffer ) < 0 ) {
+		syslog( LOG_ERR, "Allocating table of open files failed!" );
+		exit( EXIT_FAILURE );
+	}
+	
+	/* in bulkload mode all threads share one connection and transaction,
+	 * in single-threaded case we just need one shared PostgreSQL connection */
+	if( data->bulkload > 0 ) {
+		int res;
+		
+		res = group_init( &data->group, data->conninfo, data->bulkload,
+			data->bulkdelay, data->async_commit, group_failed, data );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Starting group commit failed!" );
+			exit( EXIT_FAILURE );
+		}
+	} else if( !data->multi_threaded ) {
 		data->conn = PQconnectdb( data->conninfo );
 		if( PQstatus( data->conn ) != CONNECTION_OK ) {
 			syslog( LOG_ERR, "Connection to database failed: %s",
@@ -127,16 +604,36 @@ static void *pgfuse_init( struct fuse_conn_info *conn )
 			PQfinish( data->conn );
 			exit( EXIT_FAILURE );
 		}
+		if( data->async_commit && psql_set_async_commit( data->conn ) < 0 ) {
+			PQfinish( data->conn );
+			exit( EXIT_FAILURE );
+		}
 	} else {
 		int res;
 
-		res = psql_pool_init( &data->pool, data->conninfo, MAX_DB_CONNECTIONS );
+		res = psql_pool_init( &data->pool, data->conninfo, MAX_DB_CONNECTIONS, data->async_commit );
 		if( res < 0 ) {
 			syslog( LOG_ERR, "Allocating database connection pool failed!" );
 			exit( EXIT_FAILURE );
 		}
 	}
 	
+	if( data->engine == PSQL_ENGINE_LOG && !data->read_only ) {
+		if( compact_init( &data->compactor, data->conninfo, &data->files,
+			data->block_size, COMPACT_INTERVAL, data->verbose ) < 0 ) {
+			syslog( LOG_ERR, "Starting compaction failed!" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
+	if( !data->read_only ) {
+		if( reap_init( &data->reaper, data->conninfo, &data->files,
+			REAP_INTERVAL, data->verbose ) < 0 ) {
+			syslog( LOG_ERR, "Starting reaper failed!" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
 	return data;
 }
 
@@ -147,11 +644,23 @@ static void pgfuse_destroy( void *userdata )
 	syslog( LOG_INFO, "Unmounting file system on '%s' (%s), thread #%u",
 		data->mountpoint, data->conninfo, THREAD_ID );
 
-	if( !data->multi_threaded ) {
+	if( data->engine == PSQL_ENGINE_LOG && !data->read_only ) {
+		(void)compact_destroy( &data->compactor );
+	}
+
+	if( !data->read_only ) {
+		(void)reap_destroy( &data->reaper );
+	}
+
+	if( data->bulkload > 0 ) {
+		(void)group_destroy( &data->group );
+	} else if( !data->multi_threaded ) {
 		PQfinish( data->conn );
 	} else {
 		(void)psql_pool_destroy( &data->pool );
 	}
+
+	(void)file_table_destroy( &data->files );
 }
 
 static int pgfuse_fgetattr( const char *path, struct stat *stbuf, struct fuse_file_info *fi )
@@ -160,22 +669,33 @@ static int pgfuse_fgetattr( const char *path, struct stat *stbuf, struct fuse_fi
 	int64_t id;
 	PgMeta meta;
 	PGconn *conn;
+	PgFuseFile *f = FILE_OF( fi );
 	
 	if( data->verbose ) {
 		syslog( LOG_INFO, "FgetAttrs '%s' on '%s', thread #%u",
 			path, data->mountpoint, THREAD_ID );
 	}
 
+	if( f == NULL ) {
+		return -EBADF;
+	}
+
+	if( stat_spooled( data, path, stbuf ) ) {
+		return 0;
+	}
+
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
 	memset( stbuf, 0, sizeof( struct stat ) );
 
-	id = psql_read_meta( conn, fi->fh, path, &meta );
+	id = psql_read_meta( conn, f->id, path, &meta );
 	if( id < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
+	
+	file_table_meta( &data->files, id, &meta );
 
 	if( data->verbose ) {
 		syslog( LOG_DEBUG, "Id for %s '%s' is %"PRIi64", thread #%u",
@@ -188,7 +708,7 @@ static int pgfuse_fgetattr( const char *path, struct stat *stbuf, struct fuse_fi
 	stbuf->st_blocks = 0;
 	stbuf->st_mode = meta.mode;
 	stbuf->st_size = meta.size;
-	stbuf->st_blksize = data->block_size;
+	stbuf->st_blksize = ( meta.block_size > 0 ) ? meta.block_size : data->block_size;
 	stbuf->st_blocks = ( meta.size + data->block_size - 1 ) / data->block_size;
 	/* TODO: set correctly from table */
 	stbuf->st_nlink = 1;
@@ -212,6 +732,10 @@ static int pgfuse_getattr( const char *path, struct stat *stbuf )
 			path, data->mountpoint, THREAD_ID );
 	}
 
+	if( stat_spooled( data, path, stbuf ) ) {
+		return 0;
+	}
+
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
@@ -222,6 +746,10 @@ static int pgfuse_getattr( const char *path, struct stat *stbuf )
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
+	
+	if( !S_ISDIR( meta.mode ) ) {
+		file_table_meta( &data->files, id, &meta );
+	}
 
 	if( data->verbose ) {
 		syslog( LOG_DEBUG, "Id for %s '%s' is %"PRIi64", thread #%u",
@@ -234,7 +762,7 @@ static int pgfuse_getattr( const char *path, struct stat *stbuf )
 	stbuf->st_blocks = 0;
 	stbuf->st_mode = meta.mode;
 	stbuf->st_size = meta.size;
-	stbuf->st_blksize = data->block_size;
+	stbuf->st_blksize = ( meta.block_size > 0 ) ? meta.block_size : data->block_size;
 	stbuf->st_blocks = ( meta.size + data->block_size - 1 ) / data->block_size;
 	/* TODO: set correctly from table */
 	stbuf->st_nlink = 1;
@@ -293,8 +821,8 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 	char *parent_path;
 	char *new_file;
 	int64_t parent_id;
-	int64_t res;
 	PGconn *conn;
+	PgFuseFile *f;
 
 	if( data->verbose ) {
 		char *s = flags_to_string( fi->flags );
@@ -303,6 +831,10 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 		if( *s != '<' ) free( s );
 	}
 	
+	if( data->spool != NULL && file_table_spooled_meta( &data->files, path, &meta ) ) {
+		return -EEXIST;
+	}
+	
 	ACQUIRE( conn );		
 	PSQL_BEGIN( conn );
 	
@@ -311,25 +843,19 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 		return -EROFS;
 	}
 	
-	id = psql_read_meta_from_path( conn, path, &meta );
-	if( id < 0 && id != -ENOENT ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return id;
-	}
-	
-	if( id >= 0 ) {
-		if( data->verbose ) {
-			syslog( LOG_DEBUG, "Id for dir '%s' is %"PRIi64", thread #%u",
-				path, id, THREAD_ID );
+	/* a spooled file gets its entry on close, so the name is checked
+	 * now, otherwise the insert does that */
+	if( data->spool != NULL ) {
+		id = psql_read_meta_from_path( conn, path, &meta );
+		if( id < 0 && id != -ENOENT ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return id;
 		}
 		
-		if( S_ISDIR(meta.mode ) ) {
+		if( id >= 0 ) {
 			PSQL_ROLLBACK( conn ); RELEASE( conn );
-			return -EISDIR;
+			return S_ISDIR( meta.mode ) ? -EISDIR : -EEXIST;
 		}
-		
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EEXIST;
 	}
 	
 	copy_path = strdup( path );
@@ -341,15 +867,12 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 	
 	parent_path = dirname( copy_path );
 
-	parent_id = psql_read_meta_from_path( conn, parent_path, &meta );
+	parent_id = psql_path_to_id( conn, parent_path );
 	if( parent_id < 0 ) {
+		free( copy_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return parent_id;
 	}
-	if( !S_ISDIR(meta.mode ) ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -ENOENT;
-	}
 	
 	if( data->verbose ) {
 		syslog( LOG_DEBUG, "Parent_id for new file '%s' in dir '%s' is %"PRIi64", thread #%u",
@@ -359,7 +882,6 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 	free( copy_path );
 	copy_path = strdup( path );
 	if( copy_path == NULL ) {
-		free( parent_path );
 		syslog( LOG_ERR, "Out of memory in Create '%s'!", path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return -ENOMEM;
@@ -374,19 +896,25 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 	meta.ctime = now( );
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
+	meta.codec = ( data->compress ? PSQL_CODEC_FRAMED : 0 ) | ( data->dedup ? PSQL_CODEC_DEDUP : 0 );
 	
-	res = psql_create_file( conn, parent_id, path, new_file, meta );
-	if( res < 0 ) {
+	/* the file is created in the database with its data on close */
+	if( data->spool != NULL ) {
 		free( copy_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+		f = file_table_spool( &data->files, data->spool, path, parent_id, meta );
+		if( f == NULL ) {
+			return -EIO;
+		}
+		fi->fh = (uintptr_t)f;
+		return 0;
 	}
 	
-	id = psql_read_meta_from_path( conn, path, &meta );
+	id = psql_create_file( conn, parent_id, path, new_file, meta );
 	if( id < 0 ) {
 		free( copy_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+		return id;
 	}
 	
 	if( data->verbose ) {
@@ -394,13 +922,17 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 			path, id, THREAD_ID );
 	}
 	
-	fi->fh = id;
-	
 	free( copy_path );
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 	
-	return res;
+	f = file_table_open( &data->files, id, 0, 0, InvalidOid, meta.codec );
+	if( f == NULL ) {
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t)f;
+	
+	return 0;
 }
 
 
@@ -411,6 +943,7 @@ static int pgfuse_open( const char *path, struct fuse_file_info *fi )
 	int64_t id;
 	int64_t res;
 	PGconn *conn;
+	PgFuseFile *f;
 
 	if( data->verbose ) {
 		char *s = flags_to_string( fi->flags );
@@ -419,6 +952,15 @@ static int pgfuse_open( const char *path, struct fuse_file_info *fi )
 		if( *s != '<' ) free( s );
 	}
 
+	/* share the spool with the handle which created the file */
+	if( data->spool != NULL ) {
+		f = file_table_lookup_spooled( &data->files, path );
+		if( f != NULL ) {
+			fi->fh = (uintptr_t)f;
+			return 0;
+		}
+	}
+
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 
@@ -451,10 +993,14 @@ static int pgfuse_open( const char *path, struct fuse_file_info *fi )
 		return res;
 	}	
 		
-	fi->fh = id;
-
 	PSQL_COMMIT( conn ); RELEASE( conn );
 	
+	f = file_table_open( &data->files, id, meta.size, meta.block_size, meta.lo_oid, meta.codec );
+	if( f == NULL ) {
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t)f;
+	
 	return 0;
 }
 
@@ -496,6 +1042,14 @@ static int pgfuse_readdir( const char *path, void *buf, fuse_fill_dir_t filler,
 		return res;
 	}
 	
+	if( data->spool != NULL ) {
+		res = file_table_readdir( &data->files, id, buf, filler );
+		if( res < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+	}
+	
 	PSQL_COMMIT( conn ); RELEASE( conn );
 	
 	return 0;
@@ -509,8 +1063,17 @@ static int pgfuse_releasedir( const char *path, struct fuse_file_info *fi )
 
 static int pgfuse_fsyncdir( const char *path, int datasync, struct fuse_file_info *fi )
 {
-	/* nothing to do, everything is done in pgfuse_readdir currently */
-	return 0;
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	
+	if( data->verbose ) {
+		syslog( LOG_INFO, "%s on directory '%s' on '%s', thread #%u",
+			datasync ? "FDataSyncDir" : "FSyncDir", path, data->mountpoint,
+			THREAD_ID );
+	}
+	
+	/* directory operations commit immediately, we only have to wait
+	 * for asynchronous commits */
+	return sync_commits( data );
 }
 
 static int pgfuse_mkdir( const char *path, mode_t mode )
@@ -520,6 +1083,7 @@ static int pgfuse_mkdir( const char *path, mode_t mode )
 	char *parent_path;
 	char *new_dir;
 	int64_t parent_id;
+	int64_t id;
 	int res;
 	PgMeta meta;
 	PGconn *conn;
@@ -530,6 +1094,12 @@ static int pgfuse_mkdir( const char *path, mode_t mode )
 			THREAD_ID );
 	}
 
+	/* a spooled file is stored before it is changed by path */
+	res = store_spooled_path( data, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
@@ -547,15 +1117,12 @@ static int pgfuse_mkdir( const char *path, mode_t mode )
 	
 	parent_path = dirname( copy_path );
 
-	parent_id = psql_read_meta_from_path( conn, parent_path, &meta );
+	parent_id = psql_path_to_id( conn, parent_path );
 	if( parent_id < 0 ) {
+		free( copy_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return parent_id;
 	}
-	if( !S_ISDIR( meta.mode ) ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -ENOENT;
-	}
 	
 	if( data->verbose ) {
 		syslog( LOG_DEBUG, "Parent_id for new dir '%s' is %"PRIi64", thread #%u",
@@ -581,16 +1148,16 @@ static int pgfuse_mkdir( const char *path, mode_t mode )
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
 	
-	res = psql_create_dir( conn, parent_id, path, new_dir, meta );
-	if( res < 0 ) {
+	id = psql_create_dir( conn, parent_id, path, new_dir, meta );
+	if( id < 0 ) {
 		free( copy_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+		return id;
 	}
 
 	free( copy_path );
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 	
 	return 0;
 }
@@ -630,6 +1197,13 @@ static int pgfuse_rmdir( const char *path )
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return -EROFS;
 	}
+	
+	/* files created in it which are still spooled are not in the
+	 * database yet, they would lose their parent */
+	if( data->spool != NULL && file_table_has_spooled( &data->files, id ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOTEMPTY;
+	}
 				
 	res = psql_delete_dir( conn, id, path );
 	if( res < 0 ) {
@@ -637,7 +1211,7 @@ static int pgfuse_rmdir( const char *path )
 		return res;
 	}
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 	
 	return 0;
 }
@@ -655,6 +1229,12 @@ static int pgfuse_unlink( const char *path )
 			path, data->mountpoint, THREAD_ID );
 	}
 	
+	/* a spooled file is stored before it is changed by path */
+	res = store_spooled_path( data, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
@@ -684,21 +1264,39 @@ static int pgfuse_unlink( const char *path )
 		return res;
 	}
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 	
 	return 0;
 }
 
 static int pgfuse_flush( const char *path, struct fuse_file_info *fi )
 {
-	/* nothing to do, data is always persistent in database */
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
+	
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Flush of '%s' on '%s', thread #%u",
+			path, data->mountpoint, THREAD_ID );
+	}
 
-	return 0;
+	if( fi->fh == 0 ) {
+		return -EBADF;
+	}
+	
+	/* write the dirty blocks in the write-back buffer, report failed
+	 * group commits */
+	res = flush_file_locked( data, FILE_OF( fi ), path );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	return file_error( &data->files, FILE_OF( fi ) );
 }
 
 static int pgfuse_fsync( const char *path, int isdatasync, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
 	
 	if( data->verbose ) {
 		syslog( LOG_INFO, "%s on file '%s' on '%s', thread #%u",
@@ -714,66 +1312,131 @@ static int pgfuse_fsync( const char *path, int isdatasync, struct fuse_file_info
 		return -EBADF;
 	}
 	
-	/* nothing to do, data is always persistent in database */
+	/* store a spooled file and write the dirty blocks in the write-back
+	 * buffer, after that data is always persistent in database, unless
+	 * we commit asynchronously */
+	res = store_file_locked( data, FILE_OF( fi ), path );
+	if( res < 0 ) {
+		return res;
+	}
 	
-	/* TODO: if we have a per transaction/file transaction policy, we must change this here! */
+	res = sync_commits( data );
+	if( res < 0 ) {
+		return res;
+	}
 	
-	return 0;
+	return file_error( &data->files, FILE_OF( fi ) );
 }
 
 static int pgfuse_release( const char *path, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	PgFuseFile *f = FILE_OF( fi );
+	int res;
 
-	/* nothing to do given the simple transaction model */
-	
 	if( data->verbose ) {
 		syslog( LOG_INFO, "Releasing '%s' on '%s', thread #%u",
 			path, data->mountpoint, THREAD_ID );
 	}
 
-	return 0;
+	if( f == NULL ) {
+		return 0;
+	}
+
+	/* store a spooled file, write what is left in the write-back buffer */
+	res = store_file_locked( data, f, path );
+	if( res == 0 ) {
+		res = file_error( &data->files, f );
+	}
+	
+	(void)file_table_close( &data->files, f );
+	fi->fh = 0;
+
+	return res;
 }
 
-static int pgfuse_write( const char *path, const char *buf, size_t size,
-                         off_t offset, struct fuse_file_info *fi )
+/* move a file growing past lothreshold into a large object */
+static int migrate_file( PgFuseData *data, PgFuseFile *f, const char *path )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	int64_t tmp;
-	int res;
-	PgMeta meta;
+	int64_t lo_oid;
 	PGconn *conn;
 
 	if( data->verbose ) {
-		syslog( LOG_INFO, "Write to '%s' from offset %jd, size %zu on '%s', thread #%u",
-			path, offset, size, data->mountpoint,
-			THREAD_ID );
+		syslog( LOG_DEBUG, "Moving file '%s' into a large object, thread #%u",
+			path, THREAD_ID );
 	}
 
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
-	
-	if( fi->fh == 0 ) {
+
+	lo_oid = psql_lo_migrate( conn, f->block_size, data->engine, f->id, path );
+	if( lo_oid < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EBADF;
+		return lo_oid;
 	}
 
-	if( data->read_only ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EBADF;
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
+
+	f->lo_oid = lo_oid;
+
+	return 0;
+}
+
+/* a file growing out of its only block switches to a bigger block size
+ * before the data is written, in a transaction of its own, as the blocks
+ * written later depend on it. The caller must hold the lock of the file */
+static int grow_file( PgFuseData *data, PgFuseFile *f, const char *path, const int64_t end )
+{
+	size_t block_size;
+	int res;
+	PGconn *conn;
+
+	if( f->lo_oid != InvalidOid ) {
+		return 0;
 	}
-		
-	tmp = psql_read_meta( conn, fi->fh, path, &meta );
-	if( tmp < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return tmp;
+
+	/* the server can't copy framed blocks into a large object */
+	if( data->lo_threshold > 0 && !( f->codec & PSQL_CODEC_FRAMED ) && end > (int64_t)data->lo_threshold ) {
+		return migrate_file( data, f, path );
 	}
-	
-	if( offset + size > meta.size ) {
-		meta.size = offset + size;
+
+	block_size = psql_next_block_size( f->block_size, f->stored_size, end );
+	if( block_size == f->block_size ) {
+		return 0;
+	}
+
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Block size of file '%s' grows from %zu to %zu, thread #%u",
+			path, f->block_size, block_size, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	res = psql_write_block_size( conn, f->id, path, block_size );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
 	}
+
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
+
+	f->block_size = block_size;
+
+	return 0;
+}
+
+static int write_direct( PgFuseData *data, PgFuseFile *f, const char *path,
+                         const char *buf, size_t size, off_t offset )
+{
+	int res;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	pipeline_begin( data, f, conn );
+	PSQL_BEGIN( conn );
 	
-	res = psql_write_buf( conn, data->block_size, fi->fh, path, buf, offset, size, data->verbose );
+	res = psql_write_buf( conn, f->block_size, data->engine, f->id, f->lo_oid, f->codec, path, buf, offset, size, f->stored_size, data->verbose );
 	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
@@ -784,61 +1447,838 @@ static int pgfuse_write( const char *path, const char *buf, size_t size,
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return -EIO;
 	}
-	
-	res = psql_write_meta( conn, fi->fh, path, meta );
+
+	PSQL_COMMIT( conn );
+	res = psql_pipeline_end( conn );
 	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		RELEASE( conn );
 		return res;
 	}
-
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	joined_group( data, f );
+	RELEASE( conn );
+	
+	if( offset + size > f->stored_size ) {
+		f->stored_size = offset + size;
+	}
 	
 	return size;
 }
 
-static int pgfuse_read( const char *path, char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi )
+/* write directly to the database, bypassing the write-back buffer, the
+ * caller must hold the lock of the file */
+static int write_through( PgFuseData *data, PgFuseFile *f, const char *path,
+                          const char *buf, size_t size, off_t offset )
+{
+	unsigned int attempt = 0;
+	int res;
+
+	do {
+		res = write_direct( data, f, path, buf, size, offset );
+	} while( retry_op( data, res, &attempt ) );
+
+	return res;
+}
+
+/* a part of a big write uploaded in a transaction of its own */
+typedef struct PgWriteRange {
+	PgFuseData *data;	/* for pool, block size and verbosity */
+	PGconn *conn;		/* connection of the helper thread, NULL if the caller uploads it */
+	pthread_t thread;	/* the helper thread */
+	int64_t id;		/* id of the file */
+	const char *path;	/* path of the file (for logging) */
+	const char *buf;	/* the data of the range */
+	off_t offset;		/* offset of the range in the file */
+	size_t len;		/* length of the range */
+	int64_t size;		/* size of the file in the database */
+	size_t block_size;	/* block size of the file */
+	Oid lo_oid;		/* large object of the file, if any */
+	int codec;		/* how the blocks of the file are stored */
+	int res;		/* result of the upload */
+} PgWriteRange;
+
+static int write_range( PgWriteRange *r, PGconn *conn )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	int res;
+
+	/* writes of framed and dedup files depend on what is stored already */
+	if( r->codec == PSQL_CODEC_NONE ) {
+		(void)psql_pipeline_begin( conn );
+	}
+
+	res = psql_begin( conn );
+	if( res < 0 ) {
+		(void)psql_pipeline_end( conn );
+		return res;
+	}
+
+	res = psql_write_buf( conn, r->block_size, r->data->engine, r->id, r->lo_oid, r->codec, r->path, r->buf,
+		r->offset, r->len, r->size, r->data->verbose );
+	if( res >= 0 && res != r->len ) {
+		syslog( LOG_ERR, "Write size mismatch in file '%s', expected '%zu' to be written, but actually wrote '%d' bytes!",
+			r->path, r->len, res );
+		res = -EIO;
+	}
+	if( res < 0 ) {
+		(void)psql_rollback( conn );
+		(void)psql_pipeline_end( conn );
+		return res;
+	}
+
+	res = psql_commit( conn );
+	if( res < 0 ) {
+		(void)psql_pipeline_end( conn );
+		return res;
+	}
+
+	return psql_pipeline_end( conn );
+}
+
+static void *write_range_thread( void *arg )
+{
+	PgWriteRange *r = (PgWriteRange *)arg;
+
+	r->res = write_range( r, r->conn );
+	(void)psql_pool_release( &r->data->pool, r->conn );
+
+	return NULL;
+}
+
+/* parallel mode: split a big write into ranges of whole blocks and upload
+ * them concurrently on free connections of the pool, the caller uploads
+ * the ranges no connection is free for. Every range is a transaction of
+ * its own, so the write is not atomic. The caller must hold the lock of
+ * the file, so writes of one file stay in order */
+static int write_parallel( PgFuseData *data, PgFuseFile *f, const char *path,
+                           const char *buf, size_t size, off_t offset )
+{
+	PgWriteRange range[MAX_DB_CONNECTIONS];
+	off_t bound[MAX_DB_CONNECTIONS + 1];
+	size_t n;
+	size_t i;
+	size_t chunk;
 	PGconn *conn;
+	int res;
+
+	n = size / PARALLEL_MIN_RANGE;
+	if( n > data->parallel ) n = data->parallel;
+	if( n > MAX_DB_CONNECTIONS ) n = MAX_DB_CONNECTIONS;
+	if( n < 1 ) n = 1;
+	chunk = size / n;
+
+	/* ranges never share a block */
+	bound[0] = offset;
+	for( i = 1; i < n; i++ ) {
+		bound[i] = ( offset + i * chunk ) / f->block_size * f->block_size;
+		if( bound[i] < bound[i - 1] ) {
+			bound[i] = bound[i - 1];
+		}
+	}
+	bound[n] = offset + size;
+
+	for( i = 0; i < n; i++ ) {
+		range[i].data = data;
+		range[i].conn = NULL;
+		range[i].id = f->id;
+		range[i].path = path;
+		range[i].buf = buf + ( bound[i] - offset );
+		range[i].offset = bound[i];
+		range[i].len = bound[i + 1] - bound[i];
+		range[i].size = f->stored_size;
+		range[i].block_size = f->block_size;
+		range[i].lo_oid = f->lo_oid;
+		range[i].codec = f->codec;
+		range[i].res = 0;
+	}
+
+	for( i = 1; i < n; i++ ) {
+		if( range[i].len == 0 ) continue;
+		range[i].conn = psql_pool_try_acquire( &data->pool );
+		if( range[i].conn == NULL ) break;
+		if( pthread_create( &range[i].thread, NULL, write_range_thread, &range[i] ) != 0 ) {
+			(void)psql_pool_release( &data->pool, range[i].conn );
+			range[i].conn = NULL;
+			break;
+		}
+	}
 
 	if( data->verbose ) {
-		syslog( LOG_INFO, "Read to '%s' from offset %jd, size %zu on '%s', thread #%u",
+		syslog( LOG_DEBUG, "Writing %zu octets to '%s' in %zu ranges, %zu of them in parallel, thread #%u",
+			size, path, n, i - 1, THREAD_ID );
+	}
+
+	conn = psql_acquire( data );
+	for( i = 0; i < n; i++ ) {
+		if( range[i].conn != NULL || range[i].len == 0 ) continue;
+		range[i].res = ( conn != NULL ) ? write_range( &range[i], conn ) : -EIO;
+	}
+	if( conn != NULL ) {
+		(void)psql_release( data, conn );
+	}
+
+	res = size;
+	for( i = 0; i < n; i++ ) {
+		if( range[i].conn != NULL ) {
+			(void)pthread_join( range[i].thread, NULL );
+		}
+		if( range[i].res < 0 && res >= 0 ) {
+			res = range[i].res;
+		}
+	}
+
+	if( res >= 0 && offset + size > f->stored_size ) {
+		f->stored_size = offset + size;
+	}
+
+	return res;
+}
+
+static int pgfuse_write( const char *path, const char *buf, size_t size,
+                         off_t offset, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	PgFuseFile *f = FILE_OF( fi );
+	int res;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Write to '%s' from offset %jd, size %zu on '%s', thread #%u",
 			path, offset, size, data->mountpoint,
 			THREAD_ID );
 	}
 
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
+	if( f == NULL ) {
+		return -EBADF;
+	}
+
+	if( data->read_only ) {
+		return -EBADF;
+	}
+	
+	file_lock( &data->files, f );
+	
+	/* new files are spooled locally up to spool_max, bigger ones are
+	 * stored and written directly from then on */
+	if( f->spool_fd >= 0 ) {
+		if( offset + size <= data->spool_max ) {
+			res = file_spool_write( &data->files, f, buf, offset, size, now( ) );
+			file_unlock( &data->files, f );
+			return res;
+		}
+		res = store_spooled( data, f );
+		if( res < 0 ) {
+			file_unlock( &data->files, f );
+			return res;
+		}
+	}
+	
+	res = grow_file( data, f, path, offset + size );
+	if( res < 0 ) {
+		file_unlock( &data->files, f );
+		return res;
+	}
+	
+	/* big writes are spread over several connections in parallel mode,
+	 * after older buffered data has been written */
+	if( data->parallel > 1 && size >= 2 * PARALLEL_MIN_RANGE ) {
+		res = flush_file( data, f, path );
+		if( res == 0 ) {
+			res = write_parallel( data, f, path, buf, size, offset );
+		}
+	} else {
+		/* small writes are collected in the write-back buffer, if the
+		 * buffer is full or the write doesn't fit, flush it and try again */
+		res = file_write( &data->files, f, buf, offset, size );
+		if( res == 0 ) {
+			res = flush_file( data, f, path );
+			if( res == 0 ) {
+				res = file_write( &data->files, f, buf, offset, size );
+			}
+		}
+		
+		/* too big for the write-back buffer, write directly */
+		if( res == 0 ) {
+			res = write_through( data, f, path, buf, size, offset );
+		}
+	}
+	
+	/* size and modification time are written on flush and release, or
+	 * when they have not been written for a while */
+	if( res > 0 ) {
+		file_extend( &data->files, f, offset + size, now( ) );
+		if( time( NULL ) - f->synced >= META_SYNC_INTERVAL ) {
+			int res2 = flush_file( data, f, path );
+			if( res2 < 0 ) {
+				res = res2;
+			}
+		}
+	}
+	
+	file_unlock( &data->files, f );
+	
+	return res;
+}
+
+static int pgfuse_read( const char *path, char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
+	PGconn *conn;
+	PgFuseFile *f = FILE_OF( fi );
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Read to '%s' from offset %jd, size %zu on '%s', thread #%u",
+			path, offset, size, data->mountpoint,
+			THREAD_ID );
+	}
+
+	if( f == NULL ) {
+		return -EBADF;
+	}
+
+	file_lock( &data->files, f );
+	
+	if( f->spool_fd >= 0 ) {
+		res = file_spool_read( &data->files, f, buf, offset, size );
+		file_unlock( &data->files, f );
+		return res;
+	}
+	
+	/* make sure we read what has been written before */
+	res = flush_file( data, f, path );
+	file_unlock( &data->files, f );
+	if( res < 0 ) {
+		return res;
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	res = psql_read_buf( conn, data->block_size, data->engine, f->id, path, buf, offset, size, data->verbose );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+		
+	return res;
+}
+
+/* cut off the data and adapt the size, the caller must run a transaction */
+static int truncate_file( PgFuseData *data, PGconn *conn, const int64_t id, const char *path, off_t offset, PgMeta meta )
+{
+	int res;
+
+	res = psql_truncate( conn, data->block_size, data->engine, id, path, offset );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	meta.size = offset;
+	
+	return psql_write_meta( conn, id, path, meta );
+}
+
+static int truncate_open( PgFuseData *data, PgFuseFile *f, const char *path, off_t offset )
+{
+	int64_t id;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+	
+	id = psql_read_meta( conn, f->id, path, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	file_table_meta( &data->files, id, &meta );
+
+	res = store_dirty( data, f, conn, path );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	res = truncate_file( data, conn, id, path, offset, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn );
+	joined_group( data, f );
+	RELEASE( conn );
+	
+	return 0;
+}
+
+/* truncate an open file, the caller must hold the lock of the file. The
+ * write-back buffer is written first, it's empty afterwards unless the
+ * truncate failed */
+static int ftruncate_file( PgFuseData *data, PgFuseFile *f, const char *path, off_t offset )
+{
+	int64_t stored_size = f->stored_size;
+	unsigned int attempt = 0;
+	int res;
+
+	do {
+		f->stored_size = stored_size;
+		res = truncate_open( data, f, path, offset );
+	} while( retry_op( data, res, &attempt ) );
+
+	if( res < 0 ) {
+		f->stored_size = stored_size;
+		return res;
+	}
+
+	file_discard( &data->files, f );
+
+	file_truncate( &data->files, f, offset );
+
+	return 0;
+}
+
+/* the id of the file at 'path', so the lock of the inode can be taken
+ * before the connection of the change */
+static int64_t path_to_id( PgFuseData *data, const char *path )
+{
+	int64_t id;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	id = psql_path_to_id( conn, path );
+	RELEASE( conn );
+
+	return id;
+}
+
+/* truncate a file which is not open, the caller must hold the lock of
+ * the inode */
+static int truncate_path( PgFuseData *data, const int64_t id, const char *path, off_t offset )
+{
+	PgMeta meta;
+	int64_t res;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	res = psql_read_meta( conn, id, path, &meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	if( S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EISDIR;
+	}
+
+	res = truncate_file( data, conn, id, path, offset, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
+	
+	return 0;
+}
+
+static int pgfuse_truncate( const char* path, off_t offset )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int64_t id;
+	int res;
+	unsigned int attempt = 0;
+	PgFuseFile *f;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Truncate of '%s' to size '%jd' on '%s', thread #%u",
+			path, offset, data->mountpoint, THREAD_ID );
+	}
+
+	/* a spooled file is stored before it is changed by path */
+	res = store_spooled_path( data, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	id = path_to_id( data, path );
+	if( id < 0 ) {
+		return id;
+	}
+	
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Id of file '%s' to be truncated is %"PRIi64", thread #%u",
+			path, id, THREAD_ID );
+	}
+
+	if( data->read_only ) {
+		return -EROFS;
+	}
+
+	/* the file may be open, truncate it like an open file, so the data
+	 * still in the write-back buffer is written and the size of the open
+	 * file is kept up to date */
+	f = file_table_lookup( &data->files, id );
+	if( f != NULL ) {
+		file_lock( &data->files, f );
+		res = ftruncate_file( data, f, path, offset );
+		file_unlock( &data->files, f );
+		(void)file_table_close( &data->files, f );
+		return res;
+	}
+
+	do {
+		file_table_lock_id( &data->files, id );
+		res = truncate_path( data, id, path, offset );
+		file_table_unlock_id( &data->files, id );
+	} while( retry_op( data, res, &attempt ) );
+	
+	return res;
+}
+
+static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
+	PgFuseFile *f = FILE_OF( fi );
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Truncate of '%s' to size '%jd' on '%s', thread #%u",
+			path, offset, data->mountpoint,
+			THREAD_ID );
+	}
+
+	if( f == NULL ) {
+		return -EBADF;
+	}
+
+	if( data->read_only ) {
+		return -EROFS;
+	}
+
+	file_lock( &data->files, f );
+	if( f->spool_fd >= 0 && offset <= data->spool_max ) {
+		res = file_spool_truncate( &data->files, f, offset );
+	} else {
+		res = store_spooled( data, f );
+		if( res == 0 ) {
+			res = ftruncate_file( data, f, path, offset );
+		}
+	}
+	file_unlock( &data->files, f );
+	
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+
+/* preallocate or punch a hole into an open file in one transaction, the
+ * caller must hold the lock of the file */
+static int fallocate_open( PgFuseData *data, PgFuseFile *f, const char *path, int mode, off_t offset, off_t len )
+{
+	int64_t id;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+	
+	id = psql_read_meta( conn, f->id, path, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	file_table_meta( &data->files, id, &meta );
+
+	res = store_dirty( data, f, conn, path );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	/* extending works like truncating, a small file moves out of its
+	 * directory entry if it doesn't fit anymore */
+	if( mode & FALLOC_FL_PUNCH_HOLE ) {
+		res = psql_punch_hole( conn, data->block_size, data->engine, id, path, offset, len );
+		if( res < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+	} else if( offset + len > meta.size ) {
+		res = psql_truncate( conn, data->block_size, data->engine, id, path, offset + len );
+		if( res < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+		meta.size = offset + len;
+	}
+	
+	meta.mtime = now( );
+	meta.ctime = meta.mtime;
+	
+	res = psql_write_meta( conn, id, path, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn );
+	joined_group( data, f );
+	RELEASE( conn );
+	
+	file_truncate( &data->files, f, meta.size );
+	
+	return 0;
+}
+
+/* as fallocate_open, repeated after an aborted transaction, the
+ * write-back buffer is empty afterwards unless it failed */
+static int fallocate_file( PgFuseData *data, PgFuseFile *f, const char *path, int mode, off_t offset, off_t len )
+{
+	int64_t stored_size;
+	unsigned int attempt = 0;
+	int res;
+
+	/* a bigger block size or a large object is chosen before, as for
+	 * writes */
+	if( !( mode & FALLOC_FL_PUNCH_HOLE ) && offset + len > f->size ) {
+		res = grow_file( data, f, path, offset + len );
+		if( res < 0 ) {
+			return res;
+		}
+	}
+
+	stored_size = f->stored_size;
+	do {
+		f->stored_size = stored_size;
+		res = fallocate_open( data, f, path, mode, offset, len );
+	} while( retry_op( data, res, &attempt ) );
+
+	if( res < 0 ) {
+		f->stored_size = stored_size;
+		return res;
+	}
+
+	file_discard( &data->files, f );
+
+	return 0;
+}
+
+/* blocks of zeroes are never stored, reads of missing blocks return
+ * zeroes, so there is nothing to allocate. Without FALLOC_FL_KEEP_SIZE
+ * the file is extended, with FALLOC_FL_PUNCH_HOLE the blocks of the range
+ * are deleted. Both run on the server, no data is sent */
+static int pgfuse_fallocate( const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
+	PgFuseFile *f = FILE_OF( fi );
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Fallocate of '%s' with mode %d, offset '%jd', length '%jd' on '%s', thread #%u",
+			path, mode, offset, len, data->mountpoint, THREAD_ID );
+	}
+
+	if( f == NULL ) {
+		return -EBADF;
+	}
+
+	if( offset < 0 || len <= 0 ) {
+		return -EINVAL;
+	}
+
+	/* like on Linux, holes can only be punched keeping the size */
+	if( ( mode & ~( FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE ) ) != 0 ||
+	    ( ( mode & FALLOC_FL_PUNCH_HOLE ) && !( mode & FALLOC_FL_KEEP_SIZE ) ) ) {
+		return -EOPNOTSUPP;
+	}
+
+	if( data->read_only ) {
+		return -EROFS;
+	}
+
+	if( mode == FALLOC_FL_KEEP_SIZE ) {
+		return 0;
+	}
+
+	file_lock( &data->files, f );
+	res = store_spooled( data, f );
+	if( res == 0 ) {
+		res = fallocate_file( data, f, path, mode, offset, len );
+	}
+	file_unlock( &data->files, f );
+	
+	return res;
+}
+
+#endif
+
+#if FUSE_VERSION >= 28
+
+/* replace the data of an open file by the one of another file, copied on
+ * the server in one transaction. The caller must hold the lock of the file */
+static int clone_open( PgFuseData *data, PgFuseFile *f, const char *path, const int64_t from_id )
+{
+	int64_t id;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+	
+	/* the write-back buffer goes first, its blocks would be dropped */
+	res = store_dirty( data, f, conn, path );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	res = psql_clone_file( conn, data->block_size, from_id, f->id, path );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	id = psql_read_meta( conn, f->id, path, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+	
+	meta.mtime = now( );
+	meta.ctime = meta.mtime;
+	
+	res = psql_write_meta( conn, id, path, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn );
+	joined_group( data, f );
+	RELEASE( conn );
+	
+	/* the file is stored like the source now */
+	f->block_size = ( meta.block_size > 0 ) ? meta.block_size : data->block_size;
+	f->lo_oid = meta.lo_oid;
+	f->codec = meta.codec;
+	file_truncate( &data->files, f, meta.size );
+	
+	return 0;
+}
+
+/* as clone_open, repeated after an aborted transaction, the write-back
+ * buffer is empty afterwards unless it failed */
+static int clone_file( PgFuseData *data, PgFuseFile *f, const char *path, const int64_t from_id )
+{
+	int64_t stored_size = f->stored_size;
+	unsigned int attempt = 0;
+	int res;
+
+	do {
+		f->stored_size = stored_size;
+		res = clone_open( data, f, path, from_id );
+	} while( retry_op( data, res, &attempt ) );
+
+	if( res < 0 ) {
+		f->stored_size = stored_size;
+		return res;
+	}
+
+	file_discard( &data->files, f );
+
+	return 0;
+}
+
+/* copy the file 'from' into the open file, the caller must not hold the
+ * lock of the file */
+static int clone_from( PgFuseData *data, PgFuseFile *f, const char *path, const char *from )
+{
+	PgFuseFile *from_f;
+	int64_t from_id;
+	PgMeta meta;
+	int res;
+	PGconn *conn;
+
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Cloning '%s' into '%s', thread #%u",
+			from, path, THREAD_ID );
+	}
+
+	/* the source must be in the database with all its data */
+	res = store_spooled_path( data, from );
+	if( res < 0 ) {
+		return res;
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	from_id = psql_read_meta_from_path( conn, from, &meta );
+	if( from_id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return from_id;
+	}
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	if( S_ISDIR( meta.mode ) ) {
+		return -EISDIR;
+	}
+
+	if( !S_ISREG( meta.mode ) ) {
+		return -EINVAL;
+	}
 
-	if( fi->fh == 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EBADF;
+	/* the lock of the source is released before the one of the
+	 * destination is taken, so two clones can't deadlock */
+	from_f = file_table_lookup( &data->files, from_id );
+	if( from_f != NULL ) {
+		res = flush_file_locked( data, from_f, from );
+		(void)file_table_close( &data->files, from_f );
+		if( res < 0 ) {
+			return res;
+		}
 	}
 
-	res = psql_read_buf( conn, data->block_size, fi->fh, path, buf, offset, size, data->verbose );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+	file_lock( &data->files, f );
+	res = store_spooled( data, f );
+	if( res == 0 && f->id != from_id ) {
+		res = clone_file( data, f, path, from_id );
 	}
+	file_unlock( &data->files, f );
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
-		
 	return res;
 }
 
-static int pgfuse_truncate( const char* path, off_t offset )
+/* clone 'path' and everything below it as 'to' in one transaction */
+static int clone_tree_path( PgFuseData *data, const char *path, const char *to, const int flags )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	char *copy_path;
+	char *name_path;
 	int64_t id;
-	PgMeta meta;
+	int64_t parent_id;
 	int res;
+	PgMeta meta;
 	PGconn *conn;
 
-	if( data->verbose ) {
-		syslog( LOG_INFO, "Truncate of '%s' to size '%jd' on '%s', thread #%u",
-			path, offset, data->mountpoint, THREAD_ID );
+	copy_path = strdup( to );
+	name_path = strdup( to );
+	if( copy_path == NULL || name_path == NULL ) {
+		syslog( LOG_ERR, "Out of memory in clone of '%s'!", path );
+		free( copy_path );
+		free( name_path );
+		return -ENOMEM;
 	}
 
 	ACQUIRE( conn );
@@ -846,95 +2286,119 @@ static int pgfuse_truncate( const char* path, off_t offset )
 
 	id = psql_read_meta_from_path( conn, path, &meta );
 	if( id < 0 ) {
+		free( copy_path );
+		free( name_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
-	
-	if( S_ISDIR( meta.mode ) ) {
+
+	res = psql_read_meta_from_path( conn, to, &meta );
+	if( res != -ENOENT ) {
+		free( copy_path );
+		free( name_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EISDIR;
-	}
-	
-	if( data->verbose ) {
-		syslog( LOG_DEBUG, "Id of file '%s' to be truncated is %"PRIi64", thread #%u",
-			path, id, THREAD_ID );
+		return ( res < 0 ) ? res : -EEXIST;
 	}
 
-	if( data->read_only ) {
+	parent_id = psql_read_meta_from_path( conn, dirname( copy_path ), &meta );
+	if( parent_id < 0 || !S_ISDIR( meta.mode ) ) {
+		free( copy_path );
+		free( name_path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EROFS;
+		return ( parent_id < 0 ) ? parent_id : -ENOTDIR;
 	}
 
-	res = psql_truncate( conn, data->block_size, id, path, offset );
+	res = psql_clone_tree( conn, data->block_size, id, parent_id, basename( name_path ),
+		( flags & PGFUSE_CLONE_SNAPSHOT ) ? ( S_IWUSR | S_IWGRP | S_IWOTH ) : 0, to );
+	free( copy_path );
+	free( name_path );
 	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
 	}
-	
-	meta.size = offset;
-	res = psql_write_meta( conn, id, path, meta );
+
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+/* clone 'path' and everything below it as 'to', repeated after an aborted
+ * transaction. Open files below 'path' are cloned as far as they are in
+ * the database */
+static int clone_tree( PgFuseData *data, PgFuseFile *f, const char *path, const char *to, const int flags )
+{
+	unsigned int attempt = 0;
+	int res;
+
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Cloning tree '%s' as '%s'%s, thread #%u",
+			path, to, ( flags & PGFUSE_CLONE_SNAPSHOT ) ? " (snapshot)" : "", THREAD_ID );
+	}
+
+	if( f != NULL ) {
+		res = store_file_locked( data, f, path );
+		if( res < 0 ) {
+			return res;
+		}
+	}
+
+	/* a spooled file with the name of the clone is stored, so it's found */
+	res = store_spooled_path( data, to );
 	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
 	}
-	
-	PSQL_COMMIT( conn ); RELEASE( conn );
-	
-	return 0;
+
+	do {
+		res = clone_tree_path( data, path, to, flags );
+	} while( retry_op( data, res, &attempt ) );
+
+	return res;
 }
 
-static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_info *fi )
+/* PGFUSE_IOC_CLONE copies another file of the mount into the open file,
+ * PGFUSE_IOC_CLONE_TREE clones an open directory or file. The data doesn't
+ * pass through this process */
+static int pgfuse_ioctl( const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *buf )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	int64_t id;
-	int res;
-	PgMeta meta;
-	PGconn *conn;
+	PgFuseFile *f = FILE_OF( fi );
+	PgFuseClone *clone = (PgFuseClone *)buf;
 
 	if( data->verbose ) {
-		syslog( LOG_INFO, "Truncate of '%s' to size '%jd' on '%s', thread #%u",
-			path, offset, data->mountpoint,
-			THREAD_ID );
+		syslog( LOG_INFO, "Ioctl %x on '%s' on '%s', thread #%u",
+			(unsigned int)cmd, path, data->mountpoint, THREAD_ID );
 	}
 
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
-
-	if( fi->fh == 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EBADF;
+	if( flags & FUSE_IOCTL_COMPAT ) {
+		return -ENOSYS;
 	}
-	
-	id = psql_read_meta( conn, fi->fh, path, &meta );
-	if( id < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return id;
+
+	if( (unsigned int)cmd != PGFUSE_IOC_CLONE && (unsigned int)cmd != PGFUSE_IOC_CLONE_TREE ) {
+		return -ENOTTY;
 	}
 
 	if( data->read_only ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return -EROFS;
 	}
-	
-	res = psql_truncate( conn, data->block_size, fi->fh, path, offset );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+
+	if( memchr( clone->path, '\0', sizeof( clone->path ) ) == NULL || clone->path[0] != '/' ) {
+		return -EINVAL;
 	}
-	
-	meta.size = offset;
-	
-	res = psql_write_meta( conn, fi->fh, path, meta );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
+
+	/* directories have no open file */
+	if( (unsigned int)cmd == PGFUSE_IOC_CLONE_TREE ) {
+		return clone_tree( data, f, path, clone->path, clone->flags );
 	}
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
-	
-	return 0;
+	if( f == NULL || ( fi->flags & O_ACCMODE ) == O_RDONLY ) {
+		return -EBADF;
+	}
+
+	return clone_from( data, f, path, clone->path );
 }
 
+#endif
+
 static int pgfuse_statfs( const char *path, struct statvfs *buf )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
@@ -1096,35 +2560,39 @@ static int pgfuse_statfs( const char *path, struct statvfs *buf )
 	return 0;
 }
 
-static int pgfuse_chmod( const char *path, mode_t mode )
+/* --- changes of the metadata by path --- */
+
+#define META_MODE	1	/* change the permissions */
+#define META_OWNER	2	/* change the owner and the group */
+#define META_TIMES	4	/* change the access and modification time */
+
+/* the caller must hold the lock of the inode */
+static int write_changed_meta( PgFuseData *data, const int64_t id, const char *path, const int what, const PgMeta *change )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	int64_t id;
-	PgMeta meta;	
-	int res;
+	int64_t res;
+	PgMeta meta;
 	PGconn *conn;
 
-	if( data->verbose ) {
-		syslog( LOG_INFO, "Chmod on '%s' to mode '%o' on '%s', thread #%u",
-			path, (unsigned int)mode, data->mountpoint,
-			THREAD_ID );
-	}
-
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
-	id = psql_read_meta_from_path( conn, path, &meta );
-	if( id < 0 ) {
+	res = psql_read_meta( conn, id, path, &meta );
+	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return id;
+		return res;
 	}
 
-	if( data->read_only ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EROFS;
+	if( what & META_MODE ) {
+		meta.mode = change->mode;
+	}
+	if( what & META_OWNER ) {
+		meta.uid = change->uid;
+		meta.gid = change->gid;
+	}
+	if( what & META_TIMES ) {
+		meta.atime = change->atime;
+		meta.mtime = change->mtime;
 	}
-		
-	meta.mode = mode;
 	
 	res = psql_write_meta( conn, id, path, meta );
 	if( res < 0 ) {
@@ -1132,51 +2600,92 @@ static int pgfuse_chmod( const char *path, mode_t mode )
 		return res;
 	}
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 
 	return 0;
 }
 
-static int pgfuse_chown( const char *path, uid_t uid, gid_t gid )
+/* read, change and write the metadata under the lock of the inode, so
+ * writers of the same file don't overwrite the change or the other way
+ * round, returns the id of the file */
+static int64_t change_meta( PgFuseData *data, const char *path, const int what, const PgMeta *change )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	int64_t id;
-	PgMeta meta;	
 	int res;
-	PGconn *conn;
+	unsigned int attempt = 0;
 
-	if( data->verbose ) {
-		syslog( LOG_INFO, "Chown on '%s' to uid '%d' and gid '%d' on '%s', thread #%u",
-			path, (unsigned int)uid, (unsigned int)gid, data->mountpoint,
-			THREAD_ID );
+	/* a spooled file is stored before it is changed by path */
+	res = store_spooled_path( data, path );
+	if( res < 0 ) {
+		return res;
 	}
 	
-	ACQUIRE( conn );	
-	PSQL_BEGIN( conn );
-	
-	id = psql_read_meta_from_path( conn, path, &meta );
+	id = path_to_id( data, path );
 	if( id < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
 
-	if( data->read_only ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
+	/* times are changed on read-only mounts, too */
+	if( data->read_only && what != META_TIMES ) {
 		return -EROFS;
 	}
+
+	do {
+		file_table_lock_id( &data->files, id );
+		res = write_changed_meta( data, id, path, what, change );
+		file_table_unlock_id( &data->files, id );
+	} while( retry_op( data, res, &attempt ) );
+
+	if( res < 0 ) {
+		return res;
+	}
+
+	return id;
+}
+
+static int pgfuse_chmod( const char *path, mode_t mode )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	PgMeta change;
+	int64_t res;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Chmod on '%s' to mode '%o' on '%s', thread #%u",
+			path, (unsigned int)mode, data->mountpoint,
+			THREAD_ID );
+	}
+
+	change.mode = mode;
 	
-	meta.uid = uid;
-	meta.gid = gid;
-	
-	res = psql_write_meta( conn, id, path, meta );
+	res = change_meta( data, path, META_MODE, &change );
 	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
 	}
+
+	return 0;
+}
+
+static int pgfuse_chown( const char *path, uid_t uid, gid_t gid )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	PgMeta change;
+	int64_t res;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Chown on '%s' to uid '%d' and gid '%d' on '%s', thread #%u",
+			path, (unsigned int)uid, (unsigned int)gid, data->mountpoint,
+			THREAD_ID );
+	}
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	change.uid = uid;
+	change.gid = gid;
 	
-	return res;
+	res = change_meta( data, path, META_OWNER, &change );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	return 0;
 }
 
 static int pgfuse_symlink( const char *from, const char *to )
@@ -1196,6 +2705,12 @@ static int pgfuse_symlink( const char *from, const char *to )
 			from, to, data->mountpoint, THREAD_ID );
 	}
 
+	/* a spooled file is stored before it is changed by path */
+	res = store_spooled_path( data, to );
+	if( res < 0 ) {
+		return res;
+	}
+	
 	ACQUIRE( conn );
 	PSQL_BEGIN( conn );
 	
@@ -1208,15 +2723,12 @@ static int pgfuse_symlink( const char *from, const char *to )
 	
 	parent_path = dirname( copy_to );
 
-	parent_id = psql_read_meta_from_path( conn, parent_path, &meta );
+	parent_id = psql_path_to_id( conn, parent_path );
 	if( parent_id < 0 ) {
+		free( copy_to );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return parent_id;
 	}
-	if( !S_ISDIR( meta.mode ) ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -ENOENT;
-	}
 	
 	if( data->verbose ) {
 		syslog( LOG_DEBUG, "Parent_id for symlink '%s' is %"PRIi64", thread #%u",
@@ -1247,22 +2759,16 @@ static int pgfuse_symlink( const char *from, const char *to )
 	meta.ctime = now( );
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
+	meta.codec = PSQL_CODEC_NONE;
 	
-	res = psql_create_file( conn, parent_id, to, symlink, meta );
-	if( res < 0 ) {
-		free( copy_to );
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}
-	
-	id = psql_read_meta_from_path( conn, to, &meta );
+	id = psql_create_file( conn, parent_id, to, symlink, meta );
 	if( id < 0 ) {
 		free( copy_to );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
 
-	res = psql_write_buf( conn, data->block_size, id, to, from, 0, strlen( from ), data->verbose );
+	res = psql_write_inline( conn, data->block_size, meta.codec, id, to, from, 0, strlen( from ), 0 );
 	if( res < 0 ) {
 		free( copy_to );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
@@ -1277,7 +2783,7 @@ static int pgfuse_symlink( const char *from, const char *to )
 
 	free( copy_to );
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 	
 	return 0;
 }
@@ -1302,6 +2808,23 @@ static int pgfuse_rename( const char *from, const char *to )
 			from, to, data->mountpoint, THREAD_ID );
 	}
 
+	/* spooled files are stored before they are changed by path */
+	res = store_spooled_path( data, from );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = store_spooled_path( data, to );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* and so are the ones below a renamed directory, their paths change */
+	res = store_spooled_below( data, from );
+	if( res < 0 ) {
+		return res;
+	}
+	
 	ACQUIRE( conn );	
 	PSQL_BEGIN( conn );
 		
@@ -1375,7 +2898,7 @@ static int pgfuse_rename( const char *from, const char *to )
 	
 	free( copy_to );
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	PSQL_COMMIT_NOW( conn ); RELEASE( conn );
 
 	return res;
 }
@@ -1384,7 +2907,6 @@ static int pgfuse_readlink( const char *path, char *buf, size_t size )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	int64_t id;
-	PgMeta meta;
 	int res;
 	PGconn *conn;
 
@@ -1396,28 +2918,17 @@ static int pgfuse_readlink( const char *path, char *buf, size_t size )
 	ACQUIRE( conn );	
 	PSQL_BEGIN( conn );
 
-	id = psql_read_meta_from_path( conn, path, &meta );
+	id = psql_path_to_id( conn, path );
 	if( id < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
-	if( !S_ISLNK( meta.mode ) ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -ENOENT;
-	}
-	
-	if( size < meta.size + 1 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -ENOMEM;
-	}
 	
-	res = psql_read_buf( conn, data->block_size, id, path, buf, 0, meta.size, data->verbose );
+	res = psql_read_link( conn, id, path, buf, size );
 	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
 	}
-	
-	buf[meta.size] = '\0';
 
 	PSQL_COMMIT( conn ); RELEASE( conn );
 	
@@ -1428,9 +2939,7 @@ static int pgfuse_utimens( const char *path, const struct timespec tv[2] )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	int64_t id;
-	PgMeta meta;	
-	int res;
-	PGconn *conn;
+	PgMeta change;
 
 	if( data->verbose ) {
 		syslog( LOG_INFO, "Utimens on '%s' to access time '%d' and modification time '%d' on '%s', thread #%u",
@@ -1438,25 +2947,16 @@ static int pgfuse_utimens( const char *path, const struct timespec tv[2] )
 			THREAD_ID );
 	}
 	
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
+	change.atime = tv[0];
+	change.mtime = tv[1];
 	
-	id = psql_read_meta_from_path( conn, path, &meta );
+	id = change_meta( data, path, META_TIMES, &change );
 	if( id < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
 	}
-		
-	meta.atime = tv[0];
-	meta.mtime = tv[1];
-	
-	res = psql_write_meta( conn, id, path, meta );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}
 	
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	/* a deferred modification time of an open file must not win */
+	file_table_utime( &data->files, id, tv[1] );
 	
 	return 0;
 }
@@ -1500,8 +3000,11 @@ static struct fuse_operations pgfuse_oper = {
 	.utimens	= pgfuse_utimens,
 	.bmap		= NULL,
 #if FUSE_VERSION >= 28
-	.ioctl		= NULL,
-	.poll		= NULL
+	.ioctl		= pgfuse_ioctl,
+	.poll		= NULL,
+#endif
+#if FUSE_VERSION >= 29
+	.fallocate	= pgfuse_fallocate,
 #endif
 };
 
@@ -1516,6 +3019,17 @@ typedef struct PgFuseOptions {
 	int read_only;		/* whether to mount read-only */
 	int multi_threaded;	/* whether we run multi-threaded */
 	size_t block_size;	/* block size to use to store data in BYTEA fields */
+	size_t write_buffer;	/* size of the write-back buffer for dirty blocks */
+	int async_commit;	/* whether to commit asynchronously except on fsync */
+	size_t bulkload;	/* operations per group transaction, 0 disables it */
+	unsigned int bulkdelay;	/* milliseconds after which a group transaction commits */
+	char *spool;		/* directory to spool new files in */
+	size_t spool_max;	/* size up to which new files are spooled */
+	unsigned int parallel;	/* connections a big write is spread over */
+	int logwrite;		/* whether partial writes are appended as extents */
+	size_t lo_threshold;	/* size from which files are large objects */
+	int compress;		/* whether blocks of new files are compressed */
+	int dedup;		/* whether blocks of new files are deduplicated */
 } PgFuseOptions;
 
 #define PGFUSE_OPT( t, p, v ) { t, offsetof( PgFuseOptions, p ), v }
@@ -1529,6 +3043,17 @@ enum {
 static struct fuse_opt pgfuse_opts[] = {
 	PGFUSE_OPT( 	"ro",		read_only, 1 ),
 	PGFUSE_OPT(     "blocksize=%d",	block_size, DEFAULT_BLOCK_SIZE ),
+	PGFUSE_OPT(     "writebuffer=%lu",	write_buffer, DEFAULT_WRITE_BUFFER_SIZE ),
+	PGFUSE_OPT(     "asynccommit",	async_commit, 1 ),
+	PGFUSE_OPT(     "bulkload=%lu",	bulkload, 0 ),
+	PGFUSE_OPT(     "bulkdelay=%u",	bulkdelay, DEFAULT_BULKLOAD_DELAY ),
+	PGFUSE_OPT(     "spool=%s",	spool, 0 ),
+	PGFUSE_OPT(     "spoolmax=%lu",	spool_max, DEFAULT_SPOOL_MAX ),
+	PGFUSE_OPT(     "parallel=%u",	parallel, 0 ),
+	PGFUSE_OPT(     "logwrite",	logwrite, 1 ),
+	PGFUSE_OPT(     "lothreshold=%lu",	lo_threshold, 0 ),
+	PGFUSE_OPT(     "compress",	compress, 1 ),
+	PGFUSE_OPT(     "dedup",	dedup, 1 ),
 	FUSE_OPT_KEY( 	"-h",		KEY_HELP ),
 	FUSE_OPT_KEY( 	"--help",	KEY_HELP ),
 	FUSE_OPT_KEY( 	"-v",		KEY_VERBOSE ),
@@ -1605,6 +3130,19 @@ static void print_usage( char* progname )
 		"PgFuse options:\n"
 		"    ro                     mount filesystem read-only, do not change data in database\n"
 		"    blocksize=<bytes>      block size to use for storage of data\n"
+		"    writebuffer=<bytes>    memory for buffering small writes (0 disables it)\n"
+		"    asynccommit            commit asynchronously, only fsync waits for durability\n"
+		"    bulkload=<ops>         commit operations of all threads in groups of <ops>\n"
+		"    bulkdelay=<ms>         commit a group after <ms> milliseconds at the latest\n"
+		"    spool=<dir>            keep new files in <dir> and store them on close\n"
+		"    spoolmax=<bytes>       size up to which new files are spooled\n"
+		"    parallel=<conns>       upload big writes on up to <conns> connections,\n"
+		"                           writes are no longer atomic\n"
+		"    logwrite               append partial block writes to a log, fold\n"
+		"                           them into the blocks in the background\n"
+		"    lothreshold=<bytes>    store files growing bigger in large objects\n"
+		"    compress               compress the blocks of new files\n"
+		"    dedup                  store equal blocks of new files only once\n"
 		"\n",
 		progname
 	);
@@ -1622,8 +3160,12 @@ int main( int argc, char *argv[] )
 	const char *value;
 	
 	memset( &pgfuse, 0, sizeof( pgfuse ) );
+	memset( &userdata, 0, sizeof( PgFuseData ) );
 	pgfuse.multi_threaded = 1;
 	pgfuse.block_size = DEFAULT_BLOCK_SIZE;
+	pgfuse.write_buffer = DEFAULT_WRITE_BUFFER_SIZE;
+	pgfuse.bulkdelay = DEFAULT_BULKLOAD_DELAY;
+	pgfuse.spool_max = DEFAULT_SPOOL_MAX;
 	
 	if( fuse_opt_parse( &args, &pgfuse, pgfuse_opts, pgfuse_opt_proc ) == -1 ) {
 		if( pgfuse.print_help ) {
@@ -1649,6 +3191,15 @@ int main( int argc, char *argv[] )
 		fprintf( stderr, "See '%s -h' for usage\n", basename( argv[0] ) );
 		exit( EXIT_FAILURE );
 	}
+	
+	/* we run in / after daemonizing, so we need an absolute path */
+	if( pgfuse.spool != NULL ) {
+		userdata.spool = realpath( pgfuse.spool, NULL );
+		if( userdata.spool == NULL || access( userdata.spool, W_OK | X_OK ) < 0 ) {
+			fprintf( stderr, "Spool directory '%s' is not writable\n", pgfuse.spool );
+			exit( EXIT_FAILURE );
+		}
+	}
 		
 	/* just test if the connection can be established, do the
 	 * real connection in the fuse init function!
@@ -1698,13 +3249,28 @@ int main( int argc, char *argv[] )
 	
 	PQfinish( conn );
 	
-	memset( &userdata, 0, sizeof( PgFuseData ) );
 	userdata.conninfo = pgfuse.conninfo;
 	userdata.mountpoint = pgfuse.mountpoint;
 	userdata.verbose = pgfuse.verbose;
 	userdata.read_only = pgfuse.read_only;
 	userdata.multi_threaded = pgfuse.multi_threaded;
 	userdata.block_size = pgfuse.block_size;
+	userdata.write_buffer = pgfuse.write_buffer;
+	userdata.async_commit = pgfuse.async_commit;
+	userdata.bulkload = pgfuse.bulkload;
+	userdata.bulkdelay = pgfuse.bulkdelay;
+	userdata.spool_max = pgfuse.spool_max;
+	userdata.parallel = pgfuse.parallel;
+	userdata.engine = pgfuse.logwrite ? PSQL_ENGINE_LOG : PSQL_ENGINE_BLOCKS;
+	userdata.lo_threshold = pgfuse.lo_threshold;
+	userdata.compress = pgfuse.compress;
+	userdata.dedup = pgfuse.dedup;
+	
+	/* parallel uploads need the connection pool */
+	if( userdata.parallel > 1 && ( !userdata.multi_threaded || userdata.bulkload > 0 ) ) {
+		fprintf( stderr, "Option 'parallel' is ignored in single-threaded and bulkload mode\n" );
+		userdata.parallel = 0;
+	}
 	
 	res = fuse_main( args.argc, args.argv, &pgfuse_oper, &userdata );
 	
@@ -26,11 +26,282 @@
 #include <stdint.h>		/* for uint64_t */
 #include <inttypes.h>		/* for PRIxxx macros */
 #include <values.h>		/* for INT_MAX */
+#include <pthread.h>		/* for mutex */
+
+#ifdef __SSE2__
+#include <emmintrin.h>		/* for SSE2 intrinsics */
+#endif
 
 #include "endian.h"		/* for be64toh and htobe64 */
+#include "codec.h"		/* for codec_encode, codec_decode */
+#include "hash.h"		/* for hash_block */
 
 #include "config.h"		/* compiled in defaults */
 
+/* --- generations of the blocks of a file --- */
+
+/* truncating a file starts a new generation of blocks, statements only
+ * see the blocks of the current one, the reaper deletes older ones */
+
+#define GENERATION( P ) "( SELECT generation FROM dir WHERE id=" P "::bigint )"
+
+/* a clone reads the blocks of the file it was cloned from, statements
+ * writing blocks run after psql_own_blocks, then it's the own id */
+
+#define BLOCK_SET( P ) "( SELECT coalesce( block_set, id ) FROM dir WHERE id=" P "::bigint )"
+
+/* --- pipelined execution --- */
+
+/* write statements of one operation can be sent back to back without
+ * waiting for their results, which are checked together at the end of
+ * the pipeline. Without pipelining in libpq every statement is executed
+ * immediately */
+
+typedef struct PgPending {
+	const char *what;	/* function which sent the statement */
+	const char *path;	/* file the statement works on */
+	int64_t rows;		/* expected number of rows, -1 if not known */
+} PgPending;
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+typedef struct PgPipeline {
+	PGconn *conn;		/* connection in pipeline mode */
+	PgPending pending[PIPELINE_MAX_PENDING];	/* statements waiting for results */
+	size_t nof_pending;	/* number of statements waiting for results */
+	int res;		/* first error in the pipeline */
+	struct PgPipeline *next;	/* next connection in pipeline mode */
+} PgPipeline;
+
+static PgPipeline *pipelines = NULL;
+static pthread_mutex_t pipelines_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PgPipeline *find_pipeline( PGconn *conn )
+{
+	PgPipeline *pipeline;
+
+	if( PQpipelineStatus( conn ) == PQ_PIPELINE_OFF ) {
+		return NULL;
+	}
+
+	(void)pthread_mutex_lock( &pipelines_lock );
+	for( pipeline = pipelines; pipeline != NULL; pipeline = pipeline->next ) {
+		if( pipeline->conn == conn ) {
+			break;
+		}
+	}
+	(void)pthread_mutex_unlock( &pipelines_lock );
+
+	return pipeline;
+}
+
+#endif
+
+/* a transaction aborted by a serialization failure or a deadlock can be
+ * repeated, that's EAGAIN, a name taken in a directory is EEXIST, any
+ * other error is EIO */
+static int psql_error( PGresult *res )
+{
+	const char *state = PQresultErrorField( res, PG_DIAG_SQLSTATE );
+
+	if( state != NULL && ( strcmp( state, "40001" ) == 0 || strcmp( state, "40P01" ) == 0 ) ) {
+		return -EAGAIN;
+	}
+
+	if( state != NULL && strcmp( state, "23505" ) == 0 ) {
+		return -EEXIST;
+	}
+
+	return -EIO;
+}
+
+static int check_result( PGconn *conn, PGresult *res, const PgPending *pending )
+{
+	/* functions with side effects like lo_put are called by SELECT */
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK && PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in %s for file '%s': %s",
+			pending->what, pending->path, PQerrorMessage( conn ) );
+		return psql_error( res );
+	}
+
+	if( pending->rows >= 0 && atoi( PQcmdTuples( res ) ) != pending->rows ) {
+		syslog( LOG_ERR, "Expecting %"PRIi64" rows in %s for file '%s', not %d! Data consistency problems!",
+			pending->rows, pending->what, pending->path, atoi( PQcmdTuples( res ) ) );
+		return -EIO;
+	}
+
+	return 0;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+/* sync the pipeline and check the results of all pending statements */
+static int consume_pipeline( PgPipeline *pipeline )
+{
+	PGconn *conn = pipeline->conn;
+	PGresult *res;
+	size_t i;
+	int ok;
+
+	if( PQpipelineSync( conn ) != 1 ) {
+		syslog( LOG_ERR, "Sync of pipeline failed: %s", PQerrorMessage( conn ) );
+		pipeline->res = -EIO;
+		return pipeline->res;
+	}
+
+	for( i = 0; i < pipeline->nof_pending; i++ ) {
+		res = PQgetResult( conn );
+		if( res == NULL ) {
+			syslog( LOG_ERR, "Missing result in pipeline: %s", PQerrorMessage( conn ) );
+			pipeline->res = -EIO;
+			break;
+		}
+		/* statements after a failed one are skipped by the server */
+		if( PQresultStatus( res ) != PGRES_PIPELINE_ABORTED ) {
+			ok = check_result( conn, res, &pipeline->pending[i] );
+			if( ok < 0 && pipeline->res == 0 ) {
+				pipeline->res = ok;
+			}
+		} else if( pipeline->res == 0 ) {
+			pipeline->res = -EIO;
+		}
+		PQclear( res );
+		while( ( res = PQgetResult( conn ) ) != NULL ) {
+			PQclear( res );
+		}
+	}
+	pipeline->nof_pending = 0;
+
+	res = PQgetResult( conn );
+	if( PQresultStatus( res ) != PGRES_PIPELINE_SYNC ) {
+		syslog( LOG_ERR, "Expecting end of pipeline: %s", PQerrorMessage( conn ) );
+		pipeline->res = -EIO;
+	}
+	PQclear( res );
+
+	return pipeline->res;
+}
+
+#endif
+
+/* execute a statement changing data or send it in pipeline mode */
+static int psql_exec( PGconn *conn, const char *what, const char *path, const char *sql, const int nof_params, const char * const *values, const int *lengths, const int *binary, const int64_t rows )
+{
+	PGresult *res;
+	PgPending pending;
+	int ok;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	PgPipeline *pipeline = find_pipeline( conn );
+
+	if( pipeline != NULL ) {
+		if( pipeline->nof_pending == PIPELINE_MAX_PENDING ) {
+			(void)consume_pipeline( pipeline );
+		}
+		if( PQsendQueryParams( conn, sql, nof_params, NULL, values, lengths, binary, 1 ) != 1 ) {
+			syslog( LOG_ERR, "Error sending %s for file '%s': %s",
+				what, path, PQerrorMessage( conn ) );
+			return -EIO;
+		}
+		pipeline->pending[pipeline->nof_pending].what = what;
+		pipeline->pending[pipeline->nof_pending].path = path;
+		pipeline->pending[pipeline->nof_pending].rows = rows;
+		pipeline->nof_pending++;
+		return 0;
+	}
+#endif
+
+	pending.what = what;
+	pending.path = path;
+	pending.rows = rows;
+
+	res = PQexecParams( conn, sql, nof_params, NULL, values, lengths, binary, 1 );
+	ok = check_result( conn, res, &pending );
+	PQclear( res );
+
+	return ok;
+}
+
+int psql_pipeline_begin( PGconn *conn )
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	PgPipeline *pipeline;
+
+	pipeline = (PgPipeline *)calloc( 1, sizeof( PgPipeline ) );
+	if( pipeline == NULL ) {
+		return -ENOMEM;
+	}
+
+	if( PQenterPipelineMode( conn ) != 1 ) {
+		syslog( LOG_ERR, "Entering pipeline mode failed: %s", PQerrorMessage( conn ) );
+		free( pipeline );
+		return -EIO;
+	}
+
+	pipeline->conn = conn;
+
+	(void)pthread_mutex_lock( &pipelines_lock );
+	pipeline->next = pipelines;
+	pipelines = pipeline;
+	(void)pthread_mutex_unlock( &pipelines_lock );
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* checks the results of all statements in the pipeline, a transaction
+ * left open by a failed statement is rolled back. Does nothing if the
+ * connection is not in pipeline mode */
+int psql_pipeline_end( PGconn *conn )
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	PgPipeline *pipeline;
+	PgPipeline **ptr;
+	PGresult *res;
+	int ok;
+
+	if( PQpipelineStatus( conn ) == PQ_PIPELINE_OFF ) {
+		return 0;
+	}
+
+	(void)pthread_mutex_lock( &pipelines_lock );
+	for( ptr = &pipelines; *ptr != NULL; ptr = &(*ptr)->next ) {
+		if( (*ptr)->conn == conn ) {
+			break;
+		}
+	}
+	pipeline = *ptr;
+	if( pipeline != NULL ) {
+		*ptr = pipeline->next;
+	}
+	(void)pthread_mutex_unlock( &pipelines_lock );
+
+	if( pipeline == NULL ) {
+		(void)PQexitPipelineMode( conn );
+		return -EINVAL;
+	}
+
+	ok = consume_pipeline( pipeline );
+	free( pipeline );
+
+	if( PQexitPipelineMode( conn ) != 1 ) {
+		syslog( LOG_ERR, "Leaving pipeline mode failed: %s", PQerrorMessage( conn ) );
+		return -EIO;
+	}
+
+	if( ok < 0 && PQtransactionStatus( conn ) != PQTRANS_IDLE ) {
+		res = PQexec( conn, "ROLLBACK" );
+		PQclear( res );
+	}
+
+	return ok;
+#else
+	return 0;
+#endif
+}
+
 /* --- helper functions --- */
 
 /* January 1, 2000, 00:00:00 UTC (in Unix epoch seconds) */
@@ -171,7 +442,7 @@ int64_t psql_read_meta( PGconn *conn, const int64_t id, const char *path, PgMeta
 	int binary[1] = { 1 };
 	
 	param1 = htonl( id );
-	res = PQexecParams( conn, "SELECT size, mode, uid, gid, ctime, mtime, atime, parent_id FROM dir WHERE id = $1::integer",
+	res = PQexecParams( conn, "SELECT size, mode, uid, gid, ctime, mtime, atime, parent_id, block_size, lo_oid, codec FROM dir WHERE id = $1::integer",
 		1, NULL, values, lengths, binary, 1 );
 	
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
@@ -219,9 +490,34 @@ int64_t psql_read_meta( PGconn *conn, const int64_t id, const char *path, PgMeta
 	data = PQgetvalue( res, 0, idx );
 	meta->atime = convert_from_timestamp( *( (uint64_t *)data ) );
 
+	/* unlinked files have no parent, the root is its own parent */
 	idx = PQfnumber( res, "parent_id" );
-	data = PQgetvalue( res, 0, idx );
-	meta->parent_id = ntohl( *( (int64_t *)data ) );
+	meta->parent_id = -1;
+	if( !PQgetisnull( res, 0, idx ) ) {
+		data = PQgetvalue( res, 0, idx );
+		meta->parent_id = be64toh( *( (int64_t *)data ) );
+	}
+	
+	idx = PQfnumber( res, "block_size" );
+	meta->block_size = 0;
+	if( !PQgetisnull( res, 0, idx ) ) {
+		data = PQgetvalue( res, 0, idx );
+		meta->block_size = ntohl( *( (uint32_t *)data ) );
+	}
+	
+	idx = PQfnumber( res, "lo_oid" );
+	meta->lo_oid = InvalidOid;
+	if( !PQgetisnull( res, 0, idx ) ) {
+		data = PQgetvalue( res, 0, idx );
+		meta->lo_oid = ntohl( *( (uint32_t *)data ) );
+	}
+	
+	idx = PQfnumber( res, "codec" );
+	meta->codec = PSQL_CODEC_NONE;
+	if( !PQgetisnull( res, 0, idx ) ) {
+		data = PQgetvalue( res, 0, idx );
+		meta->codec = ntohl( *( (uint32_t *)data ) );
+	}
 	
 	PQclear( res );
 	
@@ -253,14 +549,16 @@ int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta me
 	int lengths[8] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ), sizeof( param7 ), sizeof( param8 ) };
 	int binary[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
 	PGresult *res;
+	int rc;
 	
 	res = PQexecParams( conn, "UPDATE dir SET size=$2::bigint, mode=$3::integer, uid=$4::integer, gid=$5::integer, ctime=$6::timestamp, mtime=$7::timestamp, atime=$8::timestamp WHERE id=$1::bigint",
 		8, NULL, values, lengths, binary, 1 );
 
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Error in psql_write_meta for file '%s': %s", path, PQerrorMessage( conn ) );
+		rc = psql_error( res );
 		PQclear( res );
-		return -EIO;
+		return rc;
 	}
 
 	PQclear( res );
@@ -268,7 +566,54 @@ int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta me
 	return 0;
 }
 
-int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta )
+int psql_write_size( PGconn *conn, const int64_t id, const char *path, const int64_t size, const struct timespec mtime )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( size );
+	uint64_t param3 = convert_to_timestamp( mtime );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	
+	return psql_exec( conn, "psql_write_size", path,
+		"UPDATE dir SET size=$2::bigint, mtime=$3::timestamp WHERE id=$1::bigint",
+		3, values, lengths, binary, -1 );
+}
+
+/* insert a directory entry, returns the new id */
+static int64_t psql_insert_entry( PGconn *conn, const char *what, const char *path, const char *sql, const int nof_params, const char * const *values, const int *lengths, const int *binary )
+{
+	PGresult *res;
+	int64_t id;
+	
+	res = PQexecParams( conn, sql, nof_params, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		id = psql_error( res );
+		if( id != -EEXIST ) {
+			syslog( LOG_ERR, "Error in %s for path '%s': %s",
+				what, path, PQerrorMessage( conn ) );
+		}
+		PQclear( res );
+		return id;
+	}
+	
+	if( PQntuples( res ) != 1 ) {
+		PQclear( res );
+		return -ENOENT;
+	}
+	
+	id = be64toh( *( (int64_t *)PQgetvalue( res, 0, 0 ) ) );
+	
+	PQclear( res );
+	
+	return id;
+}
+
+/* create an entry in the directory 'parent_id', returns its id. The name
+ * is unique in the directory, it's EEXIST if it's taken, ENOENT if the
+ * parent is not a directory (anymore, 61440 == S_IFMT, 16384 == S_IFDIR) */
+int64_t psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta )
 {
 	int64_t param1 = htobe64( parent_id );
 	int64_t param2 = htobe64( meta.size );
@@ -278,103 +623,369 @@ int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, c
 	uint64_t param6 = convert_to_timestamp( meta.ctime );
 	uint64_t param7 = convert_to_timestamp( meta.mtime );
 	uint64_t param8 = convert_to_timestamp( meta.atime );
-	const char *values[9] = { (const char *)&param1, new_file, (const char *)&param2, (const char *)&param3, (const char *)&param4, (const char *)&param5, (const char *)&param6, (const char *)&param7, (const char *)&param8 };
-	int lengths[9] = { sizeof( param1 ), strlen( new_file ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ), sizeof( param7 ), sizeof( param8 ) };
-	int binary[9] = { 1, 0, 1, 1, 1, 1, 1, 1, 1 };
+	int param9 = htonl( meta.codec );
+	const char *values[10] = { (const char *)&param1, new_file, (const char *)&param2, (const char *)&param3, (const char *)&param4, (const char *)&param5, (const char *)&param6, (const char *)&param7, (const char *)&param8, (const char *)&param9 };
+	int lengths[10] = { sizeof( param1 ), strlen( new_file ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ), sizeof( param7 ), sizeof( param8 ), sizeof( param9 ) };
+	int binary[10] = { 1, 0, 1, 1, 1, 1, 1, 1, 1, 1 };
+	
+	return psql_insert_entry( conn, "psql_create_file", path, "INSERT INTO dir( parent_id, name, size, mode, uid, gid, ctime, mtime, atime, codec )"
+		" SELECT $1::bigint, $2::varchar, $3::bigint, $4::integer, $5::integer, $6::integer, $7::timestamp, $8::timestamp, $9::timestamp, $10::integer"
+		" WHERE EXISTS ( SELECT 1 FROM dir WHERE id=$1::bigint AND mode & 61440 = 16384 )"
+		" RETURNING id",
+		10, values, lengths, binary );
+}
+
+/* read the size, block size, large object and codec of a file and, if
+ * it's a small file stored inline, the requested part of its data, all
+ * come from the same row */
+static int psql_read_inline( PGconn *conn, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int64_t *size, size_t *block_size, Oid *lo_oid, int *codec, int *is_inline )
+{
+	int64_t param1 = htobe64( id );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
 	PGresult *res;
+	size_t n;
+	size_t stored;
 	
-	res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, size, mode, uid, gid, ctime, mtime, atime ) VALUES ($1::bigint, $2::varchar, $3::bigint, $4::integer, $5::integer, $6::integer, $7::timestamp, $8::timestamp, $9::timestamp )",
-		9, NULL, values, lengths, binary, 1 );
-
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_create_file for path '%s': %s",
+	res = PQexecParams( conn, "SELECT size, inline_data, block_size, lo_oid, codec FROM dir WHERE id=$1::bigint",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_read_inline for path '%s': %s",
 			path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
 	
-	if( atoi( PQcmdTuples( res ) ) != 1 ) {
-		syslog( LOG_ERR, "Expecting one new row in psql_create_file, not %d!",
-			atoi( PQcmdTuples( res ) ) );
+	if( PQntuples( res ) != 1 ) {
 		PQclear( res );
-		return -EIO;
+		return -ENOENT;
+	}
+	
+	*size = be64toh( *( (int64_t *)PQgetvalue( res, 0, 0 ) ) );
+	*is_inline = !PQgetisnull( res, 0, 1 );
+	if( !PQgetisnull( res, 0, 2 ) ) {
+		*block_size = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 2 ) ) );
+	}
+	*lo_oid = InvalidOid;
+	if( !PQgetisnull( res, 0, 3 ) ) {
+		*lo_oid = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 3 ) ) );
+	}
+	*codec = PSQL_CODEC_NONE;
+	if( !PQgetisnull( res, 0, 4 ) ) {
+		*codec = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 4 ) ) );
+	}
+	
+	n = 0;
+	if( *is_inline && offset < *size ) {
+		n = ( offset + len > *size ) ? *size - offset : len;
+		
+		/* the inline data can be shorter than the file, the rest is zeroes */
+		memset( buf, 0, n );
+		stored = PQgetlength( res, 0, 1 );
+		if( offset < stored ) {
+			memcpy( buf, PQgetvalue( res, 0, 1 ) + offset,
+				( offset + n > stored ) ? stored - offset : n );
+		}
 	}
 	
 	PQclear( res );
 	
-	return 0;
+	return n;
 }
 
-int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose )
+/* read the target of the symlink 'id' into 'buf' with one statement, it's
+ * inline or, for symlinks stored before that, in block 0 */
+int psql_read_link( PGconn *conn, const int64_t id, const char *path, char *buf, const size_t size )
 {
-	PgDataInfo info;
-	int64_t param1;
-	int64_t param2;
-	int64_t param3; 
-	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
-	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
-	int binary[3] = { 1, 1, 1 };
+	int64_t param1 = htobe64( id );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
 	PGresult *res;
-	char *zero_block;
-	int64_t block_no;
-	char *iptr;
-	char *data;
-	size_t copied;
-	int64_t db_block_no = 0;
-	int idx;
-	char *dst;
-	PgMeta meta;
-	size_t size;	
-	int64_t tmp;
-		
-	tmp = psql_read_meta( conn, id, path, &meta );
-	if( tmp < 0 ) {
-		return tmp;
+	mode_t mode;
+	size_t len;
+	
+	res = PQexecParams( conn, "SELECT mode, substring( coalesce( inline_data, ( SELECT d.data FROM data d"
+		" WHERE d.dir_id = coalesce( dir.block_set, dir.id ) AND d.generation = dir.generation AND d.block_no = 0 ), ''::bytea )"
+		" from 1 for size::integer ) FROM dir WHERE id=$1::bigint",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_read_link for path '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
 	}
-		
-	if( meta.size == 0 ) {
-		return 0;
+	
+	if( PQntuples( res ) != 1 ) {
+		PQclear( res );
+		return -ENOENT;
 	}
 	
-	size = len;
-	if( offset + size > meta.size ) {
-		size = meta.size - offset;
+	mode = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 0 ) ) );
+	if( !S_ISLNK( mode ) ) {
+		PQclear( res );
+		return -ENOENT;
 	}
 	
-	info = compute_block_info( block_size, offset, size );
+	len = PQgetlength( res, 0, 1 );
+	if( size < len + 1 ) {
+		PQclear( res );
+		return -ENOMEM;
+	}
 	
-	param1 = htobe64( id );
-	param2 = htobe64( info.from_block );
-	param3 = htobe64( info.to_block );
+	memcpy( buf, PQgetvalue( res, 0, 1 ), len );
+	buf[len] = '\0';
+	
+	PQclear( res );
+	
+	return len;
+}
 
-	res = PQexecParams( conn, "SELECT block_no, data FROM data WHERE dir_id=$1::bigint AND block_no>=$2::bigint AND block_no<=$3::bigint ORDER BY block_no ASC",
+/* log engine: overlay the extents which are not compacted yet on the data
+ * read from the blocks, in the order they have been written */
+static int psql_read_extents( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, const PgDataInfo info )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( info.from_block );
+	int64_t param3 = htobe64( info.to_block );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	PGresult *res;
+	int64_t block_no;
+	off_t start;
+	off_t end;
+	char *data;
+	int i;
+	
+	res = PQexecParams( conn, "SELECT block_no, \"offset\", data FROM extent WHERE dir_id=$1::bigint AND block_no>=$2::bigint AND block_no<=$3::bigint ORDER BY id ASC",
 		3, NULL, values, lengths, binary, 1 );
 	
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
-		syslog( LOG_ERR, "Error in psql_read_buf for path '%s'", path );
+		syslog( LOG_ERR, "Error in psql_read_extents for path '%s': %s",
+			path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
 	
-	zero_block = (char *)calloc( 1, block_size );
-	if( zero_block == NULL ) {
-		PQclear( res );
-		return -ENOMEM;
-	}
-	
-	dst = buf;
+	for( i = 0; i < PQntuples( res ); i++ ) {
+		block_no = be64toh( *( (int64_t *)PQgetvalue( res, i, 0 ) ) );
+		start = block_no * block_size + (int32_t)ntohl( *( (int32_t *)PQgetvalue( res, i, 1 ) ) );
+		end = start + PQgetlength( res, i, 2 );
+		data = PQgetvalue( res, i, 2 );
+		
+		/* clip the extent to the range read */
+		if( start < offset ) {
+			data += offset - start;
+			start = offset;
+		}
+		if( end > offset + (off_t)len ) {
+			end = offset + len;
+		}
+		if( start < end ) {
+			memcpy( buf + ( start - offset ), data, end - start );
+		}
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+/* --- large objects, for files bigger than a threshold --- */
+
+/* huge files are stored in a large object, reads and writes of any size
+ * are one statement. The server-side functions are used, as the fast-path
+ * interface of libpq doesn't work in pipeline mode */
+static int psql_lo_read( PGconn *conn, const Oid lo_oid, const char *path, char *buf, const off_t offset, const size_t len )
+{
+	uint32_t param1 = htonl( lo_oid );
+	int64_t param2 = htobe64( offset );
+	int param3 = htonl( len );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	PGresult *res;
+	size_t n;
+	
+	res = PQexecParams( conn, "SELECT lo_get( $1::oid, $2::bigint, $3::integer )",
+		3, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK || PQntuples( res ) != 1 ) {
+		syslog( LOG_ERR, "Error in psql_lo_read for file '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	/* the large object ends before the file if the file ends in a hole */
+	n = PQgetlength( res, 0, 0 );
+	if( n > len ) {
+		n = len;
+	}
+	memcpy( buf, PQgetvalue( res, 0, 0 ), n );
+	memset( buf + n, 0, len - n );
+	
+	PQclear( res );
+	
+	return len;
+}
+
+/* writes go to the own large object of the file, one shared with clones
+ * is copied first by 'dir_own_lo' */
+static int psql_lo_write( PGconn *conn, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( offset );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, buf };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), len };
+	int binary[3] = { 1, 1, 1 };
+	
+	if( psql_exec( conn, "psql_lo_write", path, "SELECT lo_put( dir_own_lo( $1::bigint ), $2::bigint, $3::bytea )",
+		3, values, lengths, binary, -1 ) < 0 ) {
+		syslog( LOG_ERR, "Unable to write %zu octets at offset %jd to large object of file '%s'!",
+			len, offset, path );
+		return -EIO;
+	}
+	
+	return len;
+}
+
+static int psql_lo_truncate( PGconn *conn, const int64_t id, const char *path, const off_t offset )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( offset );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	
+	/* descriptors are closed at the end of the transaction */
+	return psql_exec( conn, "psql_lo_truncate", path, "SELECT lo_truncate64( lo_open( dir_own_lo( $1::bigint ), 131072 ), $2::bigint )",
+		2, values, lengths, binary, -1 );
+}
+
+/* large objects have no holes, the zeroes are made by the server, in
+ * pieces of a megabyte */
+static int psql_lo_zero( PGconn *conn, const int64_t id, const char *path, const off_t offset, const off_t len )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( offset );
+	int64_t param3 = htobe64( len );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	
+	return psql_exec( conn, "psql_lo_zero", path, "SELECT count( lo_put( o.lo_oid, $2::bigint + n * 1048576,"
+		" repeat(E'\\\\000',least( $3::bigint - n * 1048576, 1048576 )::integer)::bytea ) )"
+		" FROM ( SELECT dir_own_lo( $1::bigint ) AS lo_oid ) AS o, generate_series( 0, ( $3::bigint - 1 ) / 1048576 ) AS n",
+		3, values, lengths, binary, -1 );
+}
+
+int psql_read_buf( PGconn *conn, const size_t default_block_size, const int engine, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose )
+{
+	size_t block_size = default_block_size;
+	PgDataInfo info;
+	int64_t param1;
+	int64_t param2;
+	int64_t param3; 
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	PGresult *res;
+	char *zero_block;
+	char *short_block;
+	int64_t block_no;
+	char *iptr;
+	char *data;
+	size_t copied;
+	int64_t db_block_no = 0;
+	int idx;
+	char *dst;
+	int64_t file_size;
+	Oid lo_oid;
+	int codec;
+	int is_inline;
+	size_t size;	
+	int64_t tmp;
+	int n;
+		
+	tmp = psql_read_inline( conn, id, path, buf, offset, len, &file_size, &block_size, &lo_oid, &codec, &is_inline );
+	if( tmp < 0 || is_inline ) {
+		return tmp;
+	}
+		
+	if( offset >= file_size ) {
+		return 0;
+	}
+	
+	size = len;
+	if( offset + size > file_size ) {
+		size = file_size - offset;
+	}
+	
+	if( lo_oid != InvalidOid ) {
+		return psql_lo_read( conn, lo_oid, path, buf, offset, size );
+	}
+	
+	info = compute_block_info( block_size, offset, size );
+	
+	param1 = htobe64( id );
+	param2 = htobe64( info.from_block );
+	param3 = htobe64( info.to_block );
+
+	res = PQexecParams( conn, "SELECT d.block_no, coalesce( d.data, c.data ) FROM data d LEFT JOIN content c ON c.id = d.content_id"
+		" WHERE d.dir_id=" BLOCK_SET( "$1" ) " AND d.generation=" GENERATION( "$1" ) " AND d.block_no>=$2::bigint AND d.block_no<=$3::bigint ORDER BY d.block_no ASC",
+		3, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_read_buf for path '%s'", path );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	/* a block of zeroes followed by space for padding short blocks */
+	zero_block = (char *)calloc( 2, block_size );
+	if( zero_block == NULL ) {
+		PQclear( res );
+		return -ENOMEM;
+	}
+	short_block = zero_block + block_size;
+	
+	dst = buf;
 	copied = 0;
 	for( block_no = info.from_block, idx = 0; block_no <= info.to_block; block_no++ ) {
 		
 		/* handle sparse files */
 		if( idx < PQntuples( res ) ) {
 			iptr = PQgetvalue( res, idx, 0 );
-			db_block_no = ntohl( *( (int64_t *)iptr ) );
+			db_block_no = be64toh( *( (int64_t *)iptr ) );
 		
 			if( block_no < db_block_no ) {
 				data = zero_block;
 			} else {
 				data = PQgetvalue( res, idx, 1 );
+				n = PQgetlength( res, idx, 1 );
+				
+				/* blocks are stored without padding, the rest is zeroes */
+				if( codec & PSQL_CODEC_FRAMED ) {
+					n = codec_decode( data, n, short_block, block_size );
+					if( n < 0 ) {
+						syslog( LOG_ERR, "Block '%"PRIi64"' of file '%s' is corrupt!",
+							block_no, path );
+						PQclear( res );
+						free( zero_block );
+						return -EIO;
+					}
+					memset( short_block + n, 0, block_size - n );
+					data = short_block;
+				} else if( n < block_size ) {
+					memset( short_block, 0, block_size );
+					memcpy( short_block, data, n );
+					data = short_block;
+				}
 				idx++;
 			}
 		} else {
@@ -384,7 +995,7 @@ int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, cons
 		/* first block */
 		if( block_no == info.from_block ) {
 			
-			memcpy( dst, data + info.from_offset, info.from_len - info.from_offset );
+			memcpy( dst, data + info.from_offset, info.from_len );
 			
 			dst += info.from_len;
 			copied += info.from_len;
@@ -419,6 +1030,13 @@ int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, cons
 		return -EIO;
 	}
 	
+	if( engine == PSQL_ENGINE_LOG ) {
+		tmp = psql_read_extents( conn, block_size, id, path, buf, offset, size, info );
+		if( tmp < 0 ) {
+			return tmp;
+		}
+	}
+	
 	return copied;
 }
 
@@ -455,7 +1073,8 @@ int psql_readdir( PGconn *conn, const int64_t parent_id, void *buf, fuse_fill_di
 	return 0;
 }
 
-int psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, const char *new_dir, PgMeta meta )
+/* as psql_create_file */
+int64_t psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, const char *new_dir, PgMeta meta )
 {
 	int64_t param1 = htobe64( parent_id );
 	int param2 = htonl( meta.mode );
@@ -467,27 +1086,12 @@ int psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, co
 	const char *values[8] = { (const char *)&param1, new_dir, (const char *)&param2, (const char *)&param3, (const char *)&param4, (const char *)&param5, (const char *)&param6, (const char *)&param7 };
 	int lengths[8] = { sizeof( param1 ), strlen( new_dir ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ), sizeof( param7 ) };
 	int binary[8] = { 1, 0, 1, 1, 1, 1, 1, 1 };
-	PGresult *res;
-	
-	res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, mode, uid, gid, ctime, mtime, atime ) VALUES ($1::bigint, $2::varchar, $3::integer, $4::integer, $5::integer, $6::timestamp, $7::timestamp, $8::timestamp )",
-		8, NULL, values, lengths, binary, 1 );
-
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_create_dir for path '%s': %s", path, PQerrorMessage( conn ) );
-		PQclear( res );
-		return -EIO;
-	}
-
-	if( atoi( PQcmdTuples( res ) ) != 1 ) {
-		syslog( LOG_ERR, "Expecting one new row in psql_create_dir, not %d!",
-			atoi( PQcmdTuples( res ) ) );
-		PQclear( res );
-		return -EIO;
-	}
-	
-	PQclear( res );
 	
-	return 0;
+	return psql_insert_entry( conn, "psql_create_dir", path, "INSERT INTO dir( parent_id, name, mode, uid, gid, ctime, mtime, atime )"
+		" SELECT $1::bigint, $2::varchar, $3::integer, $4::integer, $5::integer, $6::timestamp, $7::timestamp, $8::timestamp"
+		" WHERE EXISTS ( SELECT 1 FROM dir WHERE id=$1::bigint AND mode & 61440 = 16384 )"
+		" RETURNING id",
+		8, values, lengths, binary );
 }
 
 int psql_delete_dir( PGconn *conn, const int64_t id, const char *path )
@@ -546,15 +1150,18 @@ int psql_delete_file( PGconn *conn, const int64_t id, const char *path )
 	int lengths[1] = { sizeof( param1 ) };
 	int binary[1] = { 1 };
 	PGresult *res;
+	int ok;
 	
-	res = PQexecParams( conn, "DELETE FROM dir where id=$1::bigint",
+	/* only the entry is detached, the reaper deletes the data later */
+	res = PQexecParams( conn, "UPDATE dir SET parent_id = NULL WHERE id=$1::bigint",
 		1, NULL, values, lengths, binary, 1 );
 
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_delete_dir for path '%s': %s",
+		syslog( LOG_ERR, "Error in psql_delete_file for path '%s': %s",
 			path, PQerrorMessage( conn ) );
+		ok = psql_error( res );
 		PQclear( res );
-		return -EIO;
+		return ok;
 	}
 	
 	PQclear( res );
@@ -562,210 +1169,1305 @@ int psql_delete_file( PGconn *conn, const int64_t id, const char *path )
 	return 0;
 }
 
-static int psql_write_block( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const int64_t block_no, const off_t offset, const size_t len, int verbose )
+/* unlinked files waiting for the reaper, also the ones of a crashed mount,
+ * in pages of 'max_ids' ordered by id, starting after 'after_id' */
+int psql_reap_candidates( PGconn *conn, const int64_t after_id, int64_t *ids, int *unlinked, const size_t max_ids )
 {
-	int64_t param1 = htobe64( id );
-	int64_t param2 = htobe64( block_no );
-	const char *values[3] = { (const char *)&param1, (const char *)&param2, buf };
-	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), len };
-	int binary[3] = { 1, 1, 1 };
+	int64_t param1 = htobe64( max_ids );
+	int64_t param2 = htobe64( after_id );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
 	PGresult *res;
-	char sql[256];
+	int i;
 	
-	/* could actually be an assertion, as this can never happen */
-	if( offset + len > block_size ) {
-		syslog( LOG_ERR, "Got a too big block write for file '%s', block '%20"PRIi64"': %20jd + %20zu > %zu!",
-			path, block_no, offset, len, block_size );
+	res = PQexecParams( conn, "SELECT id, parent_id IS NULL FROM dir WHERE ( parent_id IS NULL OR stale )"
+		" AND id > $2::bigint ORDER BY id LIMIT $1::bigint",
+		2, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_reap_candidates: %s", PQerrorMessage( conn ) );
+		PQclear( res );
 		return -EIO;
 	}
-
-update_again:
-
-	/* write a complete block, old data in the database doesn't bother us */
-	if( offset == 0 && len == block_size ) {
-		
-		strcpy( sql, "UPDATE data set data = $3::bytea WHERE dir_id=$1::bigint AND block_no=$2::bigint" );
-		
-	/* keep data on the right */
-	} else if( offset == 0 && len < block_size ) {
-
-		sprintf( sql, "UPDATE data set data = $3::bytea || substring( data from %zu for %zu ) WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			len + 1, block_size - len );
-
-	/* keep data on the left */
-	} else if( offset > 0 && offset + len == block_size ) {
-		
-		sprintf( sql, "UPDATE data set data = substring( data from %d for %jd ) || $3::bytea WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			1, offset );
-
-	/* small in the middle write, keep data on both sides */
-	} else if( offset > 0 && offset + len < block_size ) {
-
-		sprintf( sql, "UPDATE data set data = substring( data from %d for %jd ) || $3::bytea || substring( data from %jd for %jd ) WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			1, offset,
-			offset + len + 1, block_size - ( offset + len ) );
-						
-	/* we should never get here */
-	} else {
-		syslog( LOG_ERR, "Unhandled write case for file '%s' in block '%"PRIi64"': offset: %jd, len: %zu, blocksize: %zu",
-			path, block_no, offset, len, block_size );
-		return -EIO;
-	}		
 	
-	if( verbose ) {
-		syslog( LOG_DEBUG, "%s, block: %"PRIi64", offset: %jd, len: %zu => %s\n",
-			path, block_no, offset, len, sql );
+	for( i = 0; i < PQntuples( res ); i++ ) {
+		ids[i] = be64toh( *( (int64_t *)PQgetvalue( res, i, 0 ) ) );
+		unlinked[i] = *PQgetvalue( res, i, 1 );
 	}
 	
-	res = PQexecParams( conn, sql, 3, NULL, values, lengths, binary, 1 );
+	PQclear( res );
 	
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_write_block(%"PRIi64",%jd,%zu) for file '%s' (%s): %s",
-			block_no, offset, len, path,
-			sql, PQerrorMessage( conn ) );
-		PQclear( res );
-		return -EIO;
-	}
+	return i;
+}
 
-	/* ok, one block updated */
-	if( atoi( PQcmdTuples( res ) ) == 1 ) {
+/* delete up to 'batch' blocks, extents or pages of the large object of an
+ * unlinked file, the entry itself when nothing is left. Of a truncated file
+ * only blocks of older generations are deleted. Returns the number of rows
+ * deleted, 0 when there is nothing left. The caller runs a transaction */
+int psql_reap_file( PGconn *conn, const int64_t id, const char *path, const size_t batch )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( batch );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	/* large objects are stored in pages of 2048 octets, they are cut
+	 * from the end */
+	const char *sql[3] = {
+		"DELETE FROM data WHERE dir_id=$1::bigint AND ( generation, block_no ) IN ("
+		" SELECT d.generation, d.block_no FROM data d JOIN dir f ON f.id = d.dir_id WHERE d.dir_id=$1::bigint"
+		" AND NOT ( f.parent_id IS NOT NULL AND f.block_set IS NULL AND d.generation = f.generation )"
+		" AND NOT EXISTS ( SELECT 1 FROM block_set b WHERE b.dir_id = d.dir_id AND b.generation = d.generation )"
+		" LIMIT $2::bigint )",
+		"DELETE FROM extent WHERE id IN ("
+		" SELECT id FROM extent WHERE dir_id=$1::bigint LIMIT $2::bigint )"
+		" AND EXISTS ( SELECT 1 FROM dir WHERE id=$1::bigint AND parent_id IS NULL )",
+		"UPDATE dir SET size = greatest( size - $2::bigint * 2048, 0 )"
+		" WHERE id=$1::bigint AND parent_id IS NULL AND lo_oid IS NOT NULL AND size > 0"
+		" AND NOT EXISTS ( SELECT 1 FROM dir o WHERE o.lo_oid = dir.lo_oid AND o.id <> dir.id )"
+		" RETURNING lo_truncate64( lo_open( lo_oid, 131072 ), size )" };
+	PGresult *res;
+	int rows;
+	int i;
+	
+	for( i = 0; i < 3; i++ ) {
+		res = PQexecParams( conn, sql[i], 2, NULL, values, lengths, binary, 1 );
+		if( PQresultStatus( res ) != PGRES_COMMAND_OK && PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+			syslog( LOG_ERR, "Error in psql_reap_file for file '%s': %s",
+				path, PQerrorMessage( conn ) );
+			PQclear( res );
+			return -EIO;
+		}
+		rows = atoi( PQcmdTuples( res ) );
 		PQclear( res );
-		return len;
+		if( rows > 0 ) {
+			return rows;
+		}
 	}
-
-	/* funny problems */
-	if( atoi( PQcmdTuples( res ) ) != 0 ) {
-		syslog( LOG_ERR, "Unable to update block '%"PRIi64"' of file '%s'! Data consistency problems!",
-			block_no, path );
+	
+	res = PQexecParams( conn, "DELETE FROM dir WHERE id=$1::bigint AND parent_id IS NULL",
+		1, NULL, values, lengths, binary, 1 );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_reap_file for file '%s': %s",
+			path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
+	PQclear( res );
 	
+	/* a truncated file is done when no older generation is left */
+	res = PQexecParams( conn, "UPDATE dir SET stale = false WHERE id=$1::bigint AND parent_id IS NOT NULL"
+		" AND NOT EXISTS ( SELECT 1 FROM data d WHERE d.dir_id=$1::bigint"
+		" AND NOT ( dir.block_set IS NULL AND d.generation = dir.generation )"
+		" AND NOT EXISTS ( SELECT 1 FROM block_set b WHERE b.dir_id = d.dir_id AND b.generation = d.generation ) )",
+		1, NULL, values, lengths, binary, 1 );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_reap_file for file '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
 	PQclear( res );
 	
-	/* the block didn't exist, so create one */
-	sprintf( sql, "INSERT INTO data( dir_id, block_no, data ) VALUES"
-		" ( $1::bigint, $2::bigint, repeat(E'\\\\000',%zu)::bytea )", block_size );
-	res = PQexecParams( conn, sql, 2, NULL, values, lengths, binary, 1 );
+	return 0;
+}
 
+/* delete up to 'batch' blocks of shared sets nobody refers to anymore,
+ * the empty sets when nothing is left. Returns the number of blocks
+ * deleted. The caller runs a transaction */
+int psql_reap_sets( PGconn *conn, const size_t batch )
+{
+	int64_t param1 = htobe64( batch );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
+	PGresult *res;
+	int rows;
+	
+	res = PQexecParams( conn, "DELETE FROM data WHERE ( dir_id, generation, block_no ) IN ("
+		" SELECT d.dir_id, d.generation, d.block_no FROM block_set b"
+		" JOIN data d ON d.dir_id = b.dir_id AND d.generation = b.generation"
+		" WHERE b.refcount = 0 LIMIT $1::bigint )",
+		1, NULL, values, lengths, binary, 1 );
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_write_block(%"PRIi64",%jd,%zu) for file '%s' allocating new block '%"PRIi64"': %s",
-			block_no, offset, len, path, block_no, PQerrorMessage( conn ) );
+		syslog( LOG_ERR, "Error in psql_reap_sets: %s", PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
+	rows = atoi( PQcmdTuples( res ) );
+	PQclear( res );
+	if( rows > 0 ) {
+		return rows;
+	}
 	
-	if( atoi( PQcmdTuples( res ) ) != 1 ) {
-		syslog( LOG_ERR, "Unable to add new block '%"PRIi64"' of file '%s'! Data consistency problems!",
-			block_no, path );
+	res = PQexec( conn, "DELETE FROM block_set b WHERE refcount = 0"
+		" AND NOT EXISTS ( SELECT 1 FROM data d WHERE d.dir_id = b.dir_id AND d.generation = b.generation )" );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_reap_sets: %s", PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
-	
 	PQclear( res );
 	
-	goto update_again;
+	return 0;
 }
 
-int psql_write_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len, int verbose )
+/* whether a block contains only zeroes, those are not stored, reads
+ * of missing blocks return zeroes */
+static int is_zero_block( const char *buf, const size_t len )
 {
-	PgDataInfo info;
-	int res;
-	int64_t block_no;
-	
-	if( len == 0 ) return 0;
-	
-	info = compute_block_info( block_size, offset, len );
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128( );
+	__m128i acc;
+	
+	/* check 64 octets at a time, data blocks mostly fail early */
+	for( ; i + 64 <= len; i += 64 ) {
+		acc = _mm_or_si128(
+			_mm_or_si128( _mm_loadu_si128( (const __m128i *)( buf + i ) ),
+				_mm_loadu_si128( (const __m128i *)( buf + i + 16 ) ) ),
+			_mm_or_si128( _mm_loadu_si128( (const __m128i *)( buf + i + 32 ) ),
+				_mm_loadu_si128( (const __m128i *)( buf + i + 48 ) ) ) );
+		if( _mm_movemask_epi8( _mm_cmpeq_epi8( acc, zero ) ) != 0xFFFF ) {
+			return 0;
+		}
+	}
+#else
+	uint64_t w;
 	
-	/* first (partial) block */
-	res = psql_write_block( conn, block_size, id, path, buf, info.from_block, info.from_offset, info.from_len, verbose );
-	if( res < 0 ) {
-		return res;
+	for( ; i + sizeof( w ) <= len; i += sizeof( w ) ) {
+		memcpy( &w, buf + i, sizeof( w ) );
+		if( w != 0 ) {
+			return 0;
+		}
 	}
-	if( res != info.from_len ) {
-		syslog( LOG_ERR, "Partial write in file '%s' in first block '%"PRIi64"' (%u instead of %zu octets)",
-			path, info.from_block, res, info.from_len );
-		return -EIO;
+#endif
+	for( ; i < len; i++ ) {
+		if( buf[i] != 0 ) {
+			return 0;
+		}
 	}
 	
-	/* special case of one block */
-	if( info.from_block == info.to_block ) {
-		return res;
-	}
+	return 1;
+}
+
+/* read a block into 'block', missing blocks of sparse files and the part
+ * after a short block are zeroes, returns the length stored */
+static int psql_read_block( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const int64_t block_no, char *block )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	PGresult *res;
+	int len = 0;
 	
-	buf += info.from_len;
+	res = PQexecParams( conn, "SELECT coalesce( d.data, c.data ) FROM data d LEFT JOIN content c ON c.id = d.content_id"
+		" WHERE d.dir_id=" BLOCK_SET( "$1" ) " AND d.generation=" GENERATION( "$1" ) " AND d.block_no=$2::bigint",
+		2, NULL, values, lengths, binary, 1 );
 	
-	/* all full blocks */
-	for( block_no = info.from_block + 1; block_no < info.to_block; block_no++ ) {
-		res = psql_write_block( conn, block_size, id, path, buf, block_no, 0, block_size, verbose );
-		if( res < 0 ) {
-			return res;
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_read_block for file '%s', block '%"PRIi64"': %s",
+			path, block_no, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	memset( block, 0, block_size );
+	if( PQntuples( res ) == 1 ) {
+		len = PQgetlength( res, 0, 0 );
+		if( codec & PSQL_CODEC_FRAMED ) {
+			len = codec_decode( PQgetvalue( res, 0, 0 ), len, block, block_size );
+		} else if( len <= block_size ) {
+			memcpy( block, PQgetvalue( res, 0, 0 ), len );
+		} else {
+			len = -1;
 		}
-		if( res != block_size ) {
-			syslog( LOG_ERR, "Partial write in file '%s' in block '%"PRIi64"' (%u instead of %zu octets)",
-				path, block_no, res, block_size );
+		if( len < 0 ) {
+			syslog( LOG_ERR, "Block '%"PRIi64"' of file '%s' is corrupt or bigger than %zu octets!",
+				block_no, path, block_size );
+			PQclear( res );
 			return -EIO;
 		}
-		buf += block_size;
 	}
 	
-	/* last partial block */
-	res = psql_write_block( conn, block_size, id, path, buf, info.to_block, 0, info.to_len, verbose );
-	if( res < 0 ) {
-		return res;
-	}
-	if( res != info.to_len ) {
-		syslog( LOG_ERR, "Partial write in file '%s' in last block '%"PRIi64"' (%u instead of %zu octets)",
-			path, block_no, res, info.to_len );
-		return -EIO;
-	}
+	PQclear( res );
 	
 	return len;
 }
 
-int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const off_t offset )
+/* copy on first write: a clone gets its own copy of the shared blocks
+ * before it writes one, in a new generation. The last entry of a set
+ * takes over its blocks without copying them */
+static int psql_own_blocks( PGconn *conn, const int64_t id, const char *path )
 {
+	int64_t param1 = htobe64( id );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
+	
+	return psql_exec( conn, "psql_own_blocks", path, "WITH s AS ( SELECT d.id, d.block_set, d.generation, b.refcount,"
+		" CASE WHEN b.refcount = 1 AND d.block_set = d.id THEN d.generation ELSE nextval( 'generation_seq' ) END AS new_gen"
+		" FROM dir d JOIN block_set b ON b.dir_id = d.block_set AND b.generation = d.generation"
+		" WHERE d.id=$1::bigint FOR UPDATE ),"
+		" owned AS ( UPDATE dir SET block_set = NULL, generation = s.new_gen FROM s WHERE dir.id = s.id ),"
+		" dropped AS ( DELETE FROM block_set b USING s"
+		" WHERE s.refcount = 1 AND b.dir_id = s.block_set AND b.generation = s.generation ),"
+		" released AS ( UPDATE block_set b SET refcount = b.refcount - 1 FROM s"
+		" WHERE s.refcount > 1 AND b.dir_id = s.block_set AND b.generation = s.generation ),"
+		" moved AS ( UPDATE data d SET dir_id = s.id, generation = s.new_gen FROM s"
+		" WHERE s.refcount = 1 AND s.new_gen <> s.generation AND d.dir_id = s.block_set AND d.generation = s.generation ),"
+		" counted AS ( UPDATE content c SET refcount = c.refcount + n.refs FROM ( SELECT d.content_id, count( * ) AS refs"
+		" FROM s JOIN data d ON d.dir_id = s.block_set AND d.generation = s.generation"
+		" WHERE s.refcount > 1 AND d.content_id IS NOT NULL GROUP BY d.content_id ) n WHERE c.id = n.content_id )"
+		" INSERT INTO data( dir_id, generation, block_no, data, content_id )"
+		" SELECT s.id, s.new_gen, d.block_no, d.data, d.content_id"
+		" FROM s JOIN data d ON d.dir_id = s.block_set AND d.generation = s.generation WHERE s.refcount > 1",
+		1, values, lengths, binary, -1 );
+}
+
+/* the file drops all its blocks by starting a new generation of its own,
+ * its old blocks are left to the reaper, or to its clones */
+static int psql_leave_blocks( PGconn *conn, const int64_t id, const char *path )
+{
+	int64_t param1 = htobe64( id );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
+	
+	return psql_exec( conn, "psql_leave_blocks", path, "WITH s AS ("
+		" SELECT id, block_set, generation FROM dir WHERE id=$1::bigint FOR UPDATE ),"
+		" released AS ( UPDATE block_set b SET refcount = b.refcount - 1 FROM s"
+		" WHERE b.dir_id = s.block_set AND b.generation = s.generation )"
+		" UPDATE dir SET block_set = NULL, generation = nextval( 'generation_seq' ), stale = stale OR s.block_set IS NULL"
+		" FROM s WHERE dir.id = s.id AND ( s.block_set IS NOT NULL"
+		" OR EXISTS ( SELECT 1 FROM data WHERE dir_id = s.id AND generation = s.generation ) )",
+		1, values, lengths, binary, -1 );
+}
+
+/* delete a range of blocks which became zeroes */
+static int psql_delete_blocks( PGconn *conn, const int64_t id, const char *path, const int64_t from_block, const int64_t to_block )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( from_block );
+	int64_t param3 = htobe64( to_block );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	
+	return psql_exec( conn, "psql_delete_blocks", path, "DELETE FROM data WHERE dir_id=$1::bigint"
+		" AND generation=" GENERATION( "$1" ) " AND block_no>=$2::bigint AND block_no<=$3::bigint",
+		3, values, lengths, binary, -1 );
+}
+
+/* dedup files: a full block is stored once in 'content', the block refers
+ * to it. The reference to known content is counted first, which locks the
+ * content row, so it can't vanish, only the hash is sent for it. Only
+ * unknown content is uploaded, framed for framed files. The trigger on
+ * 'data' drops the references */
+static int psql_write_content( PGconn *conn, const int codec, const int64_t id, const char *path, const char *buf, const int64_t block_no, const size_t len, int verbose )
+{
+	unsigned char hash[HASH_SIZE];
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	int param4 = htonl( codec & PSQL_CODEC_FRAMED );
+	const char *values[5] = { (const char *)&param1, (const char *)&param2, (const char *)hash, (const char *)&param4, buf };
+	int lengths[5] = { sizeof( param1 ), sizeof( param2 ), HASH_SIZE, sizeof( param4 ), len };
+	int binary[5] = { 1, 1, 1, 1, 1 };
+	PGresult *dbres;
+	char *frame = NULL;
+	int found;
+	int res;
+	
+	hash_block( buf, len, hash );
+	
+	dbres = PQexecParams( conn, "WITH c AS ( UPDATE content SET refcount = refcount + 1"
+		" WHERE hash=$3::bytea AND codec=$4::integer RETURNING id )"
+		" INSERT INTO data( dir_id, generation, block_no, data, content_id )"
+		" SELECT $1::bigint, " GENERATION( "$1" ) ", $2::bigint, NULL, id FROM c"
+		" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = NULL, content_id = EXCLUDED.content_id",
+		4, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( dbres ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_write_content for file '%s', block '%"PRIi64"': %s",
+			path, block_no, PQerrorMessage( conn ) );
+		res = psql_error( dbres );
+		PQclear( dbres );
+		return res;
+	}
+	
+	found = atoi( PQcmdTuples( dbres ) );
+	PQclear( dbres );
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, block: %"PRIi64", len: %zu, known content: %d\n",
+			path, block_no, len, found );
+	}
+	
+	if( found == 1 ) {
+		return len;
+	}
+	
+	if( codec & PSQL_CODEC_FRAMED ) {
+		frame = (char *)malloc( CODEC_FRAME_MAX( len ) );
+		if( frame == NULL ) {
+			return -ENOMEM;
+		}
+		values[4] = frame;
+		lengths[4] = codec_encode( buf, len, frame );
+	}
+	
+	/* a concurrent writer can have uploaded it in the meantime */
+	res = psql_exec( conn, "psql_write_content", path, "WITH c AS ("
+		" INSERT INTO content( hash, codec, refcount, data ) VALUES ( $3::bytea, $4::integer, 1, $5::bytea )"
+		" ON CONFLICT ( hash, codec ) DO UPDATE SET refcount = content.refcount + 1 RETURNING id )"
+		" INSERT INTO data( dir_id, generation, block_no, data, content_id )"
+		" SELECT $1::bigint, " GENERATION( "$1" ) ", $2::bigint, NULL, id FROM c"
+		" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = NULL, content_id = EXCLUDED.content_id",
+		5, values, lengths, binary, 1 );
+	
+	free( frame );
+	
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Unable to write content of block '%"PRIi64"' (len %zu) of file '%s'!",
+			block_no, len, path );
+		return res;
+	}
+	
+	return len;
+}
+
+/* framed files: replace a block by 'len' octets, compressed if that pays
+ * off. The server can't look into frames, so they are always replaced as
+ * a whole. A block of zeroes is a hole */
+static int psql_write_frame( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const int64_t block_no, const size_t len, int verbose )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, NULL };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), 0 };
+	int binary[3] = { 1, 1, 1 };
+	char *frame;
+	int res;
+	
+	if( is_zero_block( buf, len ) ) {
+		if( psql_delete_blocks( conn, id, path, block_no, block_no ) < 0 ) {
+			return -EIO;
+		}
+		return len;
+	}
+	
+	if( ( codec & PSQL_CODEC_DEDUP ) && len == block_size ) {
+		return psql_write_content( conn, codec, id, path, buf, block_no, len, verbose );
+	}
+	
+	frame = (char *)malloc( CODEC_FRAME_MAX( len ) );
+	if( frame == NULL ) {
+		return -ENOMEM;
+	}
+	values[2] = frame;
+	lengths[2] = codec_encode( buf, len, frame );
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, block: %"PRIi64", len: %zu, frame: %d\n",
+			path, block_no, len, lengths[2] );
+	}
+	
+	res = psql_exec( conn, "psql_write_frame", path, "INSERT INTO data( dir_id, generation, block_no, data ) VALUES"
+		" ( $1::bigint, " GENERATION( "$1" ) ", $2::bigint, $3::bytea )"
+		" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = EXCLUDED.data, content_id = NULL",
+		3, values, lengths, binary, 1 );
+	
+	free( frame );
+	
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Unable to write frame of block '%"PRIi64"' (len %zu) of file '%s'!",
+			block_no, len, path );
+		return -EIO;
+	}
+	
+	return len;
+}
+
+/* framed files: merge a partial write with the block, read here */
+static int psql_merge_frame( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const int64_t block_no, const off_t offset, const size_t len, int verbose )
+{
+	char *block;
+	int used;
+	
+	block = (char *)malloc( block_size );
+	if( block == NULL ) {
+		return -ENOMEM;
+	}
+	
+	used = psql_read_block( conn, block_size, codec, id, path, block_no, block );
+	if( used >= 0 ) {
+		memcpy( block + offset, buf, len );
+		if( offset + len > used ) {
+			used = offset + len;
+		}
+		used = psql_write_frame( conn, block_size, codec, id, path, block, block_no, used, verbose );
+	}
+	
+	free( block );
+	
+	return ( used < 0 ) ? used : (int)len;
+}
+
+/* framed files: cut a block after 'len' octets */
+static int psql_cut_frame( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const int64_t block_no, const size_t len )
+{
+	char *block;
+	int res;
+	
+	block = (char *)malloc( block_size );
+	if( block == NULL ) {
+		return -ENOMEM;
+	}
+	
+	res = psql_read_block( conn, block_size, codec, id, path, block_no, block );
+	if( res > (int)len ) {
+		res = psql_write_frame( conn, block_size, codec, id, path, block, block_no, len, 0 );
+	}
+	
+	free( block );
+	
+	return ( res < 0 ) ? res : 0;
+}
+
+static int psql_write_block( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const int64_t block_no, const off_t offset, const size_t len, int verbose )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	int param4 = htonl( offset );
+	const char *values[4] = { (const char *)&param1, (const char *)&param2, buf, (const char *)&param4 };
+	int lengths[4] = { sizeof( param1 ), sizeof( param2 ), len, sizeof( param4 ) };
+	int binary[4] = { 1, 1, 1, 1 };
+	const char *sql;
+	int nof_params;
+	int res;
+	
+	/* could actually be an assertion, as this can never happen */
+	if( offset + len > block_size ) {
+		syslog( LOG_ERR, "Got a too big block write for file '%s', block '%20"PRIi64"': %20jd + %20zu > %zu!",
+			path, block_no, offset, len, block_size );
+		return -EIO;
+	}
+	
+	if( codec & PSQL_CODEC_FRAMED ) {
+		if( offset == 0 && len == block_size ) {
+			return psql_write_frame( conn, block_size, codec, id, path, buf, block_no, len, verbose );
+		}
+		return psql_merge_frame( conn, block_size, codec, id, path, buf, block_no, offset, len, verbose );
+	}
+
+	/* a complete block of zeroes is a hole */
+	if( offset == 0 && len == block_size && is_zero_block( buf, len ) ) {
+		
+		if( psql_delete_blocks( conn, id, path, block_no, block_no ) < 0 ) {
+			return -EIO;
+		}
+		return len;
+	
+	} else if( offset == 0 && len == block_size && ( codec & PSQL_CODEC_DEDUP ) ) {
+		
+		return psql_write_content( conn, codec, id, path, buf, block_no, len, verbose );
+	
+	/* write a complete block, old data in the database doesn't bother us */
+	} else if( offset == 0 && len == block_size ) {
+		
+		sql = "INSERT INTO data( dir_id, generation, block_no, data ) VALUES"
+			" ( $1::bigint, " GENERATION( "$1" ) ", $2::bigint, $3::bytea )"
+			" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = EXCLUDED.data, content_id = NULL";
+		nof_params = 3;
+		
+	/* partial write, a new block is padded with zeroes on the left only,
+	 * an existing one keeps its data left and right of the write. Blocks
+	 * can be shorter than the block size, reads pad them with zeroes. The
+	 * data of a shared block is copied, the block gets its own */
+	} else {
+		
+		sql = "INSERT INTO data( dir_id, generation, block_no, data ) VALUES"
+			" ( $1::bigint, " GENERATION( "$1" ) ", $2::bigint, repeat(E'\\\\000',$4::integer)::bytea || $3::bytea )"
+			" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET content_id = NULL, data = overlay("
+			" coalesce( data.data, ( SELECT c.data FROM content c WHERE c.id = data.content_id ) )"
+			" || repeat(E'\\\\000',greatest( $4::integer - octet_length( coalesce( data.data,"
+			" ( SELECT c.data FROM content c WHERE c.id = data.content_id ) ) ), 0 ))::bytea"
+			" placing $3::bytea from $4::integer + 1 )";
+		nof_params = 4;
+	}
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, block: %"PRIi64", offset: %jd, len: %zu => %s\n",
+			path, block_no, offset, len, sql );
+	}
+	
+	/* exactly one row, anything else are funny problems */
+	res = psql_exec( conn, "psql_write_block", path, sql, nof_params, values, lengths, binary, 1 );
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Unable to write block '%"PRIi64"' (offset %jd, len %zu) of file '%s'!",
+			block_no, offset, len, path );
+		return res;
+	}
+	
+	return len;
+}
+
+/* write consecutive blocks starting at a block boundary with one statement,
+ * the server splits the buffer into blocks. Complete blocks replace
+ * existing ones, a partial last block is stored as it is, so it must be
+ * past the end of the file */
+static int psql_write_blocks( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const int64_t block_no, const size_t len, int verbose )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	int param4 = htonl( block_size );
+	const char *values[4] = { (const char *)&param1, (const char *)&param2, buf, (const char *)&param4 };
+	int lengths[4] = { sizeof( param1 ), sizeof( param2 ), len, sizeof( param4 ) };
+	int binary[4] = { 1, 1, 1, 1 };
+	size_t nof_blocks = ( len + block_size - 1 ) / block_size;
+	int res;
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, writing %zu blocks from block %"PRIi64", len: %zu\n",
+			path, nof_blocks, block_no, len );
+	}
+	
+	res = psql_exec( conn, "psql_write_blocks", path, "INSERT INTO data( dir_id, generation, block_no, data )"
+		" SELECT $1::bigint, " GENERATION( "$1" ) ", $2::bigint + n, b"
+		" FROM ( SELECT n, substring( $3::bytea from n * $4::integer + 1 for $4::integer ) AS b"
+		" FROM generate_series( 0, ( octet_length( $3::bytea ) - 1 ) / $4::integer ) AS n ) AS blocks"
+		" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = EXCLUDED.data, content_id = NULL",
+		4, values, lengths, binary, nof_blocks );
+	
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Unable to write %zu blocks from block '%"PRIi64"' of file '%s'!",
+			nof_blocks, block_no, path );
+		return -EIO;
+	}
+	
+	return len;
+}
+
+/* the block size of a file grows with the file as long as it has at most
+ * one block, blocks are not padded, so no data has to be moved. Returns
+ * the block size for writing the file up to 'end' */
+size_t psql_next_block_size( const size_t block_size, const int64_t size, const int64_t end )
+{
+	size_t next = block_size;
+	
+	if( size > (int64_t)block_size ) {
+		return block_size;
+	}
+	
+	while( end > (int64_t)next && next * BLOCK_SIZE_GROWTH <= MAX_BLOCK_SIZE ) {
+		next *= BLOCK_SIZE_GROWTH;
+	}
+	
+	return next;
+}
+
+int psql_write_block_size( PGconn *conn, const int64_t id, const char *path, const size_t block_size )
+{
+	int64_t param1 = htobe64( id );
+	int param2 = htonl( block_size );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	
+	return psql_exec( conn, "psql_write_block_size", path, "UPDATE dir SET block_size=$2::integer WHERE id=$1::bigint",
+		2, values, lengths, binary, 1 );
+}
+
+/* files up to this size are stored inline, they fit into block 0 */
+static size_t inline_max( const size_t block_size )
+{
+	return ( block_size < INLINE_MAX_SIZE ) ? block_size : INLINE_MAX_SIZE;
+}
+
+/* framed files: the server can't unpack block 0, it's read here. Only
+ * a file without inline data is merged, its blocks are left behind */
+static int psql_inline_frame( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path )
+{
+	int64_t param1 = htobe64( id );
+	const char *values[2] = { (const char *)&param1, NULL };
+	int lengths[2] = { sizeof( param1 ), 0 };
+	int binary[2] = { 1, 1 };
+	PGresult *dbres;
+	char *block;
+	int merged;
+	int res;
+	
+	dbres = PQexecParams( conn, "UPDATE dir SET inline_data = ''::bytea WHERE id=$1::bigint AND inline_data IS NULL",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( dbres ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_inline_frame for file '%s': %s",
+			path, PQerrorMessage( conn ) );
+		res = psql_error( dbres );
+		PQclear( dbres );
+		return res;
+	}
+	
+	merged = atoi( PQcmdTuples( dbres ) );
+	PQclear( dbres );
+	
+	if( merged == 0 ) {
+		return 0;
+	}
+	
+	block = (char *)malloc( block_size );
+	if( block == NULL ) {
+		return -ENOMEM;
+	}
+	
+	res = psql_read_block( conn, block_size, codec, id, path, 0, block );
+	if( res >= 0 ) {
+		values[1] = block;
+		lengths[1] = res;
+		res = psql_exec( conn, "psql_inline_frame", path, "UPDATE dir SET inline_data = $2::bytea WHERE id=$1::bigint",
+			2, values, lengths, binary, 1 );
+	}
+	free( block );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	return psql_leave_blocks( conn, id, path );
+}
+
+/* small files and symlinks are stored in the column inline_data of their
+ * directory entry. A small file with blocks, stored before it was
+ * supported, is merged into it first, if the file is not empty. It leaves
+ * its blocks then */
+int psql_write_inline( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len, const int64_t size )
+{
+	int64_t param1 = htobe64( id );
+	int param2 = htonl( offset );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, buf };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), len };
+	int binary[3] = { 1, 1, 1 };
+	int res;
+	
+	if( size > 0 ) {
+		if( codec & PSQL_CODEC_FRAMED ) {
+			res = psql_inline_frame( conn, block_size, codec, id, path );
+		} else {
+			res = psql_exec( conn, "psql_write_inline", path, "UPDATE dir SET inline_data = coalesce("
+				" ( SELECT coalesce( d.data, c.data ) FROM data d LEFT JOIN content c ON c.id = d.content_id"
+				" WHERE d.dir_id=" BLOCK_SET( "$1" ) " AND d.generation=" GENERATION( "$1" ) " AND d.block_no=0 ), ''::bytea )"
+				" WHERE id=$1::bigint AND inline_data IS NULL",
+				1, values, lengths, binary, -1 );
+			if( res >= 0 ) {
+				res = psql_leave_blocks( conn, id, path );
+			}
+		}
+		if( res < 0 ) {
+			return res;
+		}
+	}
+	
+	if( psql_exec( conn, "psql_write_inline", path, "UPDATE dir SET inline_data = overlay("
+		" coalesce( inline_data, ''::bytea ) || repeat(E'\\\\000',greatest( $2::integer - octet_length( coalesce( inline_data, ''::bytea ) ), 0 ))::bytea"
+		" placing $3::bytea from $2::integer + 1 ) WHERE id=$1::bigint",
+		3, values, lengths, binary, 1 ) < 0 ) {
+		syslog( LOG_ERR, "Unable to write %zu inline octets at offset %jd of file '%s'!",
+			len, offset, path );
+		return -EIO;
+	}
+	
+	return len;
+}
+
+/* a small file grows out of its directory entry, the inline data becomes
+ * block 0, in a frame of the stored codec (0, see codec.h) for framed
+ * files. The entry is locked, concurrent writers find no inline data */
+static int psql_uninline( PGconn *conn, const int64_t id, const char *path )
+{
+	int64_t param1 = htobe64( id );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
+	
+	return psql_exec( conn, "psql_uninline", path, "WITH old AS ("
+		" SELECT id, generation, inline_data, codec FROM dir WHERE id=$1::bigint AND inline_data IS NOT NULL FOR UPDATE ),"
+		" cleared AS ( UPDATE dir SET inline_data = NULL FROM old WHERE dir.id = old.id )"
+		" INSERT INTO data( dir_id, generation, block_no, data ) SELECT id, generation, 0, CASE WHEN codec & 1 = 1"
+		" THEN decode( '00', 'hex' ) || int4send( octet_length( inline_data ) ) || inline_data"
+		" ELSE inline_data END FROM old"
+		" WHERE octet_length( inline_data ) > 0"
+		" ON CONFLICT ( dir_id, generation, block_no ) DO UPDATE SET data = EXCLUDED.data, content_id = NULL",
+		1, values, lengths, binary, -1 );
+}
+
+/* write consecutive blocks starting at a block boundary, runs of zero
+ * blocks are deleted where they are stored and skipped past the end of
+ * the file, so holes stay holes. Frames and content are written block by
+ * block */
+static int psql_write_runs( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const int64_t block_no, const size_t len, const int64_t size, int verbose )
+{
+	size_t pos = 0;
+	size_t start;
+	size_t n;
+	int64_t from;
+	int64_t to;
+	int zero;
+	int res = 0;
+	
+	while( pos < len ) {
+		start = pos;
+		n = ( len - pos < block_size ) ? len - pos : block_size;
+		zero = is_zero_block( buf + pos, n );
+		
+		/* extend the run as long as the blocks are of the same kind */
+		do {
+			pos += n;
+			n = ( len - pos < block_size ) ? len - pos : block_size;
+		} while( pos < len && is_zero_block( buf + pos, n ) == zero );
+		
+		from = block_no + start / block_size;
+		to = block_no + ( pos - 1 ) / block_size;
+		
+		if( !zero && codec != PSQL_CODEC_NONE ) {
+			for( n = start; n < pos && res >= 0; n += block_size ) {
+				res = psql_write_block( conn, block_size, codec, id, path, buf + n, block_no + n / block_size, 0,
+					( pos - n < block_size ) ? pos - n : block_size, verbose );
+			}
+			if( res < 0 ) {
+				return res;
+			}
+		} else if( !zero ) {
+			res = psql_write_blocks( conn, block_size, id, path, buf + start, from, pos - start, verbose );
+			if( res < 0 ) {
+				return res;
+			}
+		} else if( from * (int64_t)block_size < size ) {
+			if( verbose ) {
+				syslog( LOG_DEBUG, "%s, blocks %"PRIi64" to %"PRIi64" are zeroes\n",
+					path, from, to );
+			}
+			res = psql_delete_blocks( conn, id, path, from, to );
+			if( res < 0 ) {
+				return res;
+			}
+		}
+	}
+	
+	return len;
+}
+
+/* log engine: a partial write of a block is appended as an extent, blocks
+ * and extents are merged when reading and by the compaction */
+static int psql_write_extent( PGconn *conn, const int64_t id, const char *path, const char *buf, const int64_t block_no, const off_t offset, const size_t len, int verbose )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( block_no );
+	int param3 = htonl( offset );
+	const char *values[4] = { (const char *)&param1, (const char *)&param2, (const char *)&param3, buf };
+	int lengths[4] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ), len };
+	int binary[4] = { 1, 1, 1, 1 };
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, extent in block: %"PRIi64", offset: %jd, len: %zu\n",
+			path, block_no, offset, len );
+	}
+	
+	if( psql_exec( conn, "psql_write_extent", path, "INSERT INTO extent( dir_id, block_no, \"offset\", data )"
+		" VALUES ( $1::bigint, $2::bigint, $3::integer, $4::bytea )",
+		4, values, lengths, binary, 1 ) < 0 ) {
+		syslog( LOG_ERR, "Unable to append extent to block '%"PRIi64"' (offset %jd, len %zu) of file '%s'!",
+			block_no, offset, len, path );
+		return -EIO;
+	}
+	
+	return len;
+}
+
+/* log engine: blocks written completely make their extents obsolete */
+static int psql_delete_extents( PGconn *conn, const int64_t id, const char *path, const int64_t from_block, const int64_t to_block )
+{
+	int64_t param1 = htobe64( id );
+	int64_t param2 = htobe64( from_block );
+	int64_t param3 = htobe64( to_block );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	
+	return psql_exec( conn, "psql_delete_extents", path, "DELETE FROM extent WHERE dir_id=$1::bigint AND block_no>=$2::bigint AND block_no<=$3::bigint",
+		3, values, lengths, binary, -1 );
+}
+
+int psql_write_buf( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const Oid lo_oid, const int codec, const char *path, const char *buf, const off_t offset, const size_t len, const int64_t size, int verbose )
+{
+	int res;
+	size_t head_len;
+	size_t tail_len;
+	size_t bulk_len;
+	int64_t block_no;
+	
+	if( len == 0 ) return 0;
+	
+	if( lo_oid != InvalidOid ) {
+		return psql_lo_write( conn, id, path, buf, offset, len );
+	}
+	
+	/* small files stay in their directory entry as long as they are small */
+	if( size <= (int64_t)inline_max( block_size ) ) {
+		if( offset + len <= inline_max( block_size ) ) {
+			return psql_write_inline( conn, block_size, codec, id, path, buf, offset, len, size );
+		}
+		res = psql_uninline( conn, id, path );
+		if( res < 0 ) {
+			return res;
+		}
+	}
+	
+	res = psql_own_blocks( conn, id, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* first partial block, merged with the existing data */
+	head_len = 0;
+	if( offset % block_size > 0 ) {
+		head_len = block_size - offset % block_size;
+		if( head_len > len ) {
+			head_len = len;
+		}
+		if( engine == PSQL_ENGINE_LOG ) {
+			res = psql_write_extent( conn, id, path, buf, offset / block_size, offset % block_size, head_len, verbose );
+		} else {
+			res = psql_write_block( conn, block_size, codec, id, path, buf, offset / block_size, offset % block_size, head_len, verbose );
+		}
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != head_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' in first block '%"PRIi64"' (%u instead of %zu octets)",
+				path, (int64_t)( offset / block_size ), res, head_len );
+			return -EIO;
+		}
+	}
+	
+	bulk_len = len - head_len;
+	if( bulk_len == 0 ) {
+		return len;
+	}
+	
+	/* last partial block, if it exists we must keep the data on the
+	 * right, otherwise it's appended to the file with the full blocks */
+	tail_len = ( offset + len ) % block_size;
+	block_no = ( offset + len ) / block_size;
+	if( tail_len > 0 && block_no * (int64_t)block_size < size ) {
+		bulk_len -= tail_len;
+		if( engine == PSQL_ENGINE_LOG ) {
+			res = psql_write_extent( conn, id, path, buf + head_len + bulk_len, block_no, 0, tail_len, verbose );
+		} else {
+			res = psql_write_block( conn, block_size, codec, id, path, buf + head_len + bulk_len, block_no, 0, tail_len, verbose );
+		}
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != tail_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' in last block '%"PRIi64"' (%u instead of %zu octets)",
+				path, block_no, res, tail_len );
+			return -EIO;
+		}
+	}
+	
+	/* all full blocks and appended blocks in one go */
+	if( bulk_len > 0 ) {
+		block_no = ( offset + head_len ) / block_size;
+		if( engine == PSQL_ENGINE_LOG ) {
+			res = psql_delete_extents( conn, id, path, block_no, block_no + ( bulk_len - 1 ) / block_size );
+			if( res < 0 ) {
+				return res;
+			}
+		}
+		res = psql_write_runs( conn, block_size, codec, id, path, buf + head_len, block_no, bulk_len, size, verbose );
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != bulk_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' from block '%"PRIi64"' (%u instead of %zu octets)",
+				path, block_no, res, bulk_len );
+			return -EIO;
+		}
+	}
+	
+	return len;
+}
+
+/* fold all extents of a file into its blocks, returns the number of
+ * blocks rewritten. Must run in a transaction, extents appended by a
+ * concurrent transaction are kept for the next compaction */
+int psql_compact_file( PGconn *conn, const size_t default_block_size, const int64_t id, const char *path, int verbose )
+{
+	size_t block_size = default_block_size;
+	int codec = PSQL_CODEC_NONE;
+	int64_t param1 = htobe64( id );
+	int64_t param2;
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	PGresult *res;
+	char *block;
+	int64_t block_no;
+	int64_t extent_id;
+	int64_t max_id = 0;
+	int offset;
+	int len;
+	int nof_blocks = 0;
+	int used;
+	int rc = 0;
+	int i;
+	
+	/* serializes with truncates and compactions of other connections */
+	res = PQexecParams( conn, "SELECT block_size, codec FROM dir WHERE id=$1::bigint FOR UPDATE",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error locking file '%s' in psql_compact_file: %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	/* deleted in the meantime, so are its extents */
+	if( PQntuples( res ) == 0 ) {
+		PQclear( res );
+		return 0;
+	}
+	
+	if( !PQgetisnull( res, 0, 0 ) ) {
+		block_size = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 0 ) ) );
+	}
+	if( !PQgetisnull( res, 0, 1 ) ) {
+		codec = ntohl( *( (uint32_t *)PQgetvalue( res, 0, 1 ) ) );
+	}
+	
+	PQclear( res );
+	
+	res = PQexecParams( conn, "SELECT id, block_no, \"offset\", data FROM extent WHERE dir_id=$1::bigint ORDER BY block_no ASC, id ASC",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_compact_file for file '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	if( PQntuples( res ) == 0 ) {
+		PQclear( res );
+		return 0;
+	}
+	
+	rc = psql_own_blocks( conn, id, path );
+	if( rc < 0 ) {
+		PQclear( res );
+		return rc;
+	}
+	
+	block = (char *)malloc( block_size );
+	if( block == NULL ) {
+		PQclear( res );
+		return -ENOMEM;
+	}
+	
+	for( i = 0; i < PQntuples( res ) && rc >= 0; ) {
+		block_no = be64toh( *( (int64_t *)PQgetvalue( res, i, 1 ) ) );
+		
+		rc = psql_read_block( conn, block_size, codec, id, path, block_no, block );
+		if( rc < 0 ) {
+			break;
+		}
+		used = rc;
+		
+		/* apply the extents of the block in the order they were written */
+		for( ; i < PQntuples( res ) && be64toh( *( (int64_t *)PQgetvalue( res, i, 1 ) ) ) == block_no; i++ ) {
+			extent_id = be64toh( *( (int64_t *)PQgetvalue( res, i, 0 ) ) );
+			offset = (int32_t)ntohl( *( (int32_t *)PQgetvalue( res, i, 2 ) ) );
+			len = PQgetlength( res, i, 3 );
+			
+			if( offset < 0 || offset + len > block_size ) {
+				syslog( LOG_ERR, "Extent '%"PRIi64"' of file '%s' exceeds block '%"PRIi64"'!",
+					extent_id, path, block_no );
+				rc = -EIO;
+				break;
+			}
+			
+			memcpy( block + offset, PQgetvalue( res, i, 3 ), len );
+			if( offset + len > used ) {
+				used = offset + len;
+			}
+			if( extent_id > max_id ) {
+				max_id = extent_id;
+			}
+		}
+		if( rc < 0 ) {
+			break;
+		}
+		
+		/* the block covers the old block, so it replaces it completely */
+		if( codec & PSQL_CODEC_FRAMED ) {
+			rc = psql_write_frame( conn, block_size, codec, id, path, block, block_no, used, verbose );
+		} else {
+			rc = psql_write_block( conn, block_size, codec, id, path, block, block_no, 0, used, verbose );
+		}
+		nof_blocks++;
+	}
+	
+	free( block );
+	PQclear( res );
+	
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	param2 = htobe64( max_id );
+	
+	rc = psql_exec( conn, "psql_compact_file", path, "DELETE FROM extent WHERE dir_id=$1::bigint AND id<=$2::bigint",
+		2, values, lengths, binary, -1 );
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "Compacted %d blocks of file '%s'", nof_blocks, path );
+	}
+	
+	return nof_blocks;
+}
+
+/* files with extents to compact, returns the number of ids */
+int psql_compact_candidates( PGconn *conn, int64_t *ids, const size_t max_ids )
+{
+	int64_t param1 = htobe64( max_ids );
+	const char *values[1] = { (const char *)&param1 };
+	int lengths[1] = { sizeof( param1 ) };
+	int binary[1] = { 1 };
+	PGresult *res;
+	int i;
+	
+	res = PQexecParams( conn, "SELECT DISTINCT dir_id FROM extent LIMIT $1::bigint",
+		1, NULL, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_compact_candidates: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	for( i = 0; i < PQntuples( res ); i++ ) {
+		ids[i] = be64toh( *( (int64_t *)PQgetvalue( res, i, 0 ) ) );
+	}
+	
+	PQclear( res );
+	
+	return i;
+}
+
+/* move the data of a file into a new large object, blocks, extents and
+ * inline data are copied by the server, so the blocks must not be framed.
+ * Returns the oid of the object */
+int64_t psql_lo_migrate( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const char *path )
+{
+	int64_t param1 = htobe64( id );
+	uint32_t param2;
+	int64_t param3 = htobe64( block_size );
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
+	int binary[3] = { 1, 1, 1 };
+	PGresult *res;
+	Oid lo_oid;
+	int rc;
+	
+	if( engine == PSQL_ENGINE_LOG ) {
+		rc = psql_compact_file( conn, block_size, id, path, 0 );
+		if( rc < 0 ) {
+			return rc;
+		}
+	}
+	
+	rc = psql_uninline( conn, id, path );
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	res = PQexec( conn, "SELECT lo_create( 0 )" );
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK || PQntuples( res ) != 1 ) {
+		syslog( LOG_ERR, "Error creating large object for file '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	lo_oid = (Oid)strtoul( PQgetvalue( res, 0, 0 ), NULL, 10 );
+	PQclear( res );
+	
+	param2 = htonl( lo_oid );
+	
+	/* holes stay holes, reads past the object return zeroes */
+	rc = psql_exec( conn, "psql_lo_migrate", path, "SELECT count(*) FROM ( SELECT lo_put( $2::oid, d.block_no * $3::bigint, coalesce( d.data, c.data ) )"
+		" FROM data d LEFT JOIN content c ON c.id = d.content_id WHERE d.dir_id=" BLOCK_SET( "$1" )
+		" AND d.generation=" GENERATION( "$1" ) " ) AS copied",
+		3, values, lengths, binary, -1 );
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	rc = psql_exec( conn, "psql_lo_migrate", path, "UPDATE dir SET lo_oid=$2::oid WHERE id=$1::bigint",
+		2, values, lengths, binary, 1 );
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	rc = psql_leave_blocks( conn, id, path );
+	if( rc < 0 ) {
+		return rc;
+	}
+	
+	return lo_oid;
+}
+
+int psql_truncate( PGconn *conn, const size_t default_block_size, const int engine, const int64_t id, const char *path, const off_t offset )
+{
+	size_t block_size;
 	PgDataInfo info;
 	int64_t res;
 	PgMeta meta;
 	int64_t param1;
 	int64_t param2;
-	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
-	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
-	int binary[2] = { 1, 1 };
+	const char *values[3] = { (const char *)&param1, (const char *)&param2, NULL };
+	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), 0 };
+	int binary[3] = { 1, 1, 1 };
 	PGresult *dbres;
-	char sql[256];
+	char sql[512];
+	char *block;
 	
 	res = psql_read_meta( conn, id, path, &meta );
 	if( res < 0 ) {
 		return res;
 	}
+	block_size = ( meta.block_size > 0 ) ? meta.block_size : default_block_size;
+	
+	if( meta.lo_oid != InvalidOid ) {
+		res = psql_lo_truncate( conn, id, path, offset );
+		if( res < 0 ) {
+			return res;
+		}
+		meta.size = offset;
+		return psql_write_meta( conn, id, path, meta );
+	}
+	
+	/* extents must not survive behind the new end of the file, none
+	 * survives truncating to zero, so there is nothing to compact */
+	if( engine == PSQL_ENGINE_LOG ) {
+		if( offset == 0 ) {
+			res = psql_delete_extents( conn, id, path, 0, INT64_MAX );
+		} else {
+			res = psql_compact_file( conn, block_size, id, path, 0 );
+		}
+		if( res < 0 ) {
+			return res;
+		}
+	}
+	
+	/* a small file is kept inline, from blocks or the inline data */
+	if( offset <= (int64_t)inline_max( block_size ) ) {
+		param1 = htobe64( id );
+		param2 = htobe64( offset );
+		
+		if( meta.codec & PSQL_CODEC_FRAMED ) {
+			
+			/* the server can't unpack block 0, it's read here */
+			block = (char *)malloc( block_size );
+			if( block == NULL ) {
+				return -ENOMEM;
+			}
+			res = psql_read_block( conn, block_size, meta.codec, id, path, 0, block );
+			if( res >= 0 ) {
+				values[2] = block;
+				lengths[2] = res;
+				res = psql_exec( conn, "psql_truncate", path, "UPDATE dir SET inline_data = substring( coalesce( inline_data,"
+					" $3::bytea ) from 1 for $2::bigint::integer ) WHERE id=$1::bigint",
+					3, values, lengths, binary, 1 );
+			}
+			free( block );
+			
+		} else {
+			res = psql_exec( conn, "psql_truncate", path, "UPDATE dir SET inline_data = substring( coalesce( inline_data,"
+				" ( SELECT coalesce( d.data, c.data ) FROM data d LEFT JOIN content c ON c.id = d.content_id"
+				" WHERE d.dir_id=" BLOCK_SET( "$1" ) " AND d.generation=" GENERATION( "$1" ) " AND d.block_no=0 ), ''::bytea ) from 1 for $2::bigint::integer )"
+				" WHERE id=$1::bigint",
+				2, values, lengths, binary, 1 );
+		}
+		if( res < 0 ) {
+			return res;
+		}
+		
+		/* the blocks are dropped by starting a new generation, that costs
+		 * the same for any size of the file, the reaper deletes them */
+		res = psql_leave_blocks( conn, id, path );
+		if( res < 0 ) {
+			return res;
+		}
+		
+		meta.size = offset;
+		
+		return psql_write_meta( conn, id, path, meta );
+	}
+	
+	res = psql_uninline( conn, id, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = psql_own_blocks( conn, id, path );
+	if( res < 0 ) {
+		return res;
+	}
 	
 	info = compute_block_info( block_size, 0, offset );
 	
+	/* truncating to zero leaves no block at all */
 	param1 = htobe64( id );
-	param2 = htobe64( info.to_block );
+	param2 = htobe64( offset == 0 ? -1 : info.to_block );
 	
 	syslog( LOG_ERR, "TRUNC: %"PRIu64", block %jd", id, info.to_block );
 	
 	/* delete superflous blocks */
-	dbres = PQexecParams( conn, "DELETE FROM data WHERE dir_id=$1::bigint AND block_no>$2::bigint",
+	dbres = PQexecParams( conn, "DELETE FROM data WHERE dir_id=$1::bigint"
+		" AND generation=" GENERATION( "$1" ) " AND block_no>$2::bigint",
 		2, NULL, values, lengths, binary, 1 );
 	
 	if( PQresultStatus( dbres ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Error in psql_truncate for file '%s' to size '%jd': %s",
 			path, offset, PQerrorMessage( conn ) );
+		res = psql_error( dbres );
 		PQclear( dbres );
-		return -EIO;
+		return res;
 	}
 	
 	PQclear( dbres );
 	
-	/* pad right part of now last block */
-	sprintf( sql, "UPDATE data SET data = substring( data from 1 for %zd ) || "
-			"repeat(E'\\\\000',%zu)::bytea WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			info.to_len,
-			block_size - info.to_len );
+	if( meta.codec & PSQL_CODEC_FRAMED ) {
+		res = psql_cut_frame( conn, block_size, meta.codec, id, path, info.to_block, info.to_len );
+		if( res < 0 ) {
+			return res;
+		}
+		meta.size = offset;
+		return psql_write_meta( conn, id, path, meta );
+	}
+	
+	/* cut the now last block, it's not padded, a shared block gets its own */
+	sprintf( sql, "UPDATE data SET content_id = NULL, data = substring( coalesce( data,"
+			" ( SELECT c.data FROM content c WHERE c.id = data.content_id ) ) from 1 for %zd ) "
+			"WHERE dir_id=$1::bigint AND generation=" GENERATION( "$1" ) " AND block_no=$2::bigint AND octet_length( coalesce( data,"
+			" ( SELECT c.data FROM content c WHERE c.id = data.content_id ) ) ) > %zd",
+			info.to_len, info.to_len );
 
 	param1 = htobe64( id );
 	param2 = htobe64( info.to_block );			
@@ -773,14 +2475,15 @@ int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, cons
 	dbres = PQexecParams( conn, sql, 2, NULL, values, lengths, binary, 1 );
 
 	if( PQresultStatus( dbres ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_truncate for file '%s' while padding block '%jd' after size '%jd': %s",
+		syslog( LOG_ERR, "Error in psql_truncate for file '%s' while cutting block '%jd' after size '%jd': %s",
 			path, info.to_block, offset, PQerrorMessage( conn ) );
+		res = psql_error( dbres );
 		PQclear( dbres );
-		return -EIO;
+		return res;
 	}
 	
 	if( atoi( PQcmdTuples( dbres ) ) > 1 ) {
-		syslog( LOG_ERR, "Expecting COUNT(0/1) in psql_truncate in file '%s' and padded block '%jd'. Data consistency problems (%s)!",
+		syslog( LOG_ERR, "Expecting COUNT(0/1) in psql_truncate in file '%s' and cut block '%jd'. Data consistency problems (%s)!",
 			path, info.to_block, sql );
 		PQclear( dbres );
 		return -EIO;
@@ -798,10 +2501,254 @@ int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, cons
 	return 0;
 }
 
+/* zero a range of a file, clipped to its size. Blocks inside the range
+ * are deleted with one statement, the parts of the blocks at its ends are
+ * written with zeroes, no data of the range is sent */
+int psql_punch_hole( PGconn *conn, const size_t default_block_size, const int engine, const int64_t id, const char *path, const off_t offset, const off_t len )
+{
+	size_t block_size;
+	PgMeta meta;
+	int64_t res;
+	off_t end;
+	off_t head_end;
+	off_t tail_start;
+	int64_t from_block;
+	int64_t to_block;
+	char *zero;
+	
+	res = psql_read_meta( conn, id, path, &meta );
+	if( res < 0 ) {
+		return res;
+	}
+	block_size = ( meta.block_size > 0 ) ? meta.block_size : default_block_size;
+	
+	end = offset + len;
+	if( end > meta.size ) {
+		end = meta.size;
+	}
+	if( offset >= end ) {
+		return 0;
+	}
+	
+	if( meta.lo_oid != InvalidOid ) {
+		return psql_lo_zero( conn, id, path, offset, end - offset );
+	}
+	
+	zero = (char *)calloc( 1, block_size );
+	if( zero == NULL ) {
+		return -ENOMEM;
+	}
+	
+	/* a small file may be inline, it's written as a whole */
+	if( meta.size <= (int64_t)inline_max( block_size ) ) {
+		res = psql_write_buf( conn, block_size, engine, id, InvalidOid, meta.codec, path, zero, offset, end - offset, meta.size, 0 );
+		free( zero );
+		return ( res < 0 ) ? res : 0;
+	}
+	
+	/* the last block ends with the file, it's not padded */
+	from_block = ( offset + block_size - 1 ) / block_size;
+	if( end == meta.size ) {
+		to_block = ( end - 1 ) / block_size;
+	} else {
+		to_block = end / block_size - 1;
+	}
+	
+	res = 0;
+	if( from_block <= to_block ) {
+		res = psql_own_blocks( conn, id, path );
+		if( res >= 0 ) {
+			res = psql_delete_blocks( conn, id, path, from_block, to_block );
+		}
+		if( res >= 0 && engine == PSQL_ENGINE_LOG ) {
+			res = psql_delete_extents( conn, id, path, from_block, to_block );
+		}
+	}
+	
+	head_end = from_block * block_size;
+	if( head_end > end ) {
+		head_end = end;
+	}
+	if( res >= 0 && offset < head_end ) {
+		res = psql_write_buf( conn, block_size, engine, id, InvalidOid, meta.codec, path, zero, offset, head_end - offset, meta.size, 0 );
+	}
+	
+	tail_start = ( to_block + 1 ) * block_size;
+	if( tail_start < head_end ) {
+		tail_start = head_end;
+	}
+	if( res >= 0 && tail_start < end ) {
+		res = psql_write_buf( conn, block_size, engine, id, InvalidOid, meta.codec, path, zero, tail_start, end - tail_start, meta.size, 0 );
+	}
+	
+	free( zero );
+	
+	return ( res < 0 ) ? res : 0;
+}
+
+/* replace the data of file 'id' by the data of file 'from_id'. Nothing
+ * is copied, the destination leaves its blocks and shares the ones of the
+ * source, which become a shared set, or its large object. Extents of the
+ * source are compacted first */
+int psql_clone_file( PGconn *conn, const size_t default_block_size, const int64_t from_id, const int64_t id, const char *path )
+{
+	int64_t param1 = htobe64( from_id );
+	int64_t param2 = htobe64( id );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	int res;
+	
+	res = psql_compact_file( conn, default_block_size, from_id, path, 0 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* the old data of the destination goes first, the statements with
+	 * one parameter only get the destination */
+	res = psql_exec( conn, "psql_clone_file", path, "DELETE FROM extent WHERE dir_id=$1::bigint",
+		1, values + 1, lengths + 1, binary + 1, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = psql_leave_blocks( conn, id, path );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* the source refers to its set from now on, if it didn't yet */
+	res = psql_exec( conn, "psql_clone_file", path, "INSERT INTO block_set( dir_id, generation, refcount )"
+		" SELECT coalesce( block_set, id ), generation, 2 FROM dir"
+		" WHERE id=$1::bigint AND inline_data IS NULL AND lo_oid IS NULL FOR UPDATE"
+		" ON CONFLICT ( dir_id, generation ) DO UPDATE SET refcount = block_set.refcount + 1",
+		1, values, lengths, binary, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = psql_exec( conn, "psql_clone_file", path, "UPDATE dir SET block_set = id"
+		" WHERE id=$1::bigint AND block_set IS NULL AND inline_data IS NULL AND lo_oid IS NULL",
+		1, values, lengths, binary, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* the own generation of the destination is kept without a set */
+	return psql_exec( conn, "psql_clone_file", path, "UPDATE dir d SET size=s.size, block_size=s.block_size,"
+		" inline_data=s.inline_data, codec=s.codec, lo_oid=s.lo_oid, block_set=s.block_set,"
+		" generation=CASE WHEN s.block_set IS NULL THEN d.generation ELSE s.generation END"
+		" FROM dir s WHERE s.id=$1::bigint AND d.id=$2::bigint",
+		2, values, lengths, binary, 1 );
+}
+
+/* clone the tree 'from_id' as 'name' into the directory 'parent_id', the
+ * permissions in 'mask' are removed. Only directory entries are inserted,
+ * the clones share the blocks and large objects of the tree, extents are
+ * compacted first. The old and new ids are kept in a temporary table */
+int psql_clone_tree( PGconn *conn, const size_t default_block_size, const int64_t from_id, const int64_t parent_id, const char *name, const mode_t mask, const char *path )
+{
+	int64_t param1 = htobe64( from_id );
+	int64_t param2 = htobe64( parent_id );
+	int param4 = htonl( mask );
+	const char *values[4] = { (const char *)&param1, (const char *)&param2, name, (const char *)&param4 };
+	int lengths[4] = { sizeof( param1 ), sizeof( param2 ), strlen( name ), sizeof( param4 ) };
+	int binary[4] = { 1, 1, 0, 1 };
+	PGresult *dbres;
+	int res;
+	int i;
+	
+	res = psql_exec( conn, "psql_clone_tree", path, "CREATE TEMPORARY TABLE clone_map( id BIGINT PRIMARY KEY,"
+		" new_id BIGINT NOT NULL ) ON COMMIT DROP",
+		0, NULL, NULL, NULL, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* the root directory is its own parent */
+	res = psql_exec( conn, "psql_clone_tree", path, "WITH RECURSIVE tree( id ) AS ( SELECT $1::bigint"
+		" UNION ALL SELECT d.id FROM dir d JOIN tree t ON d.parent_id = t.id AND d.id <> t.id )"
+		" INSERT INTO clone_map SELECT id, nextval( 'dir_id_seq' ) FROM tree",
+		1, values, lengths, binary, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* the files are locked, so writers can't leave their blocks in between */
+	res = psql_exec( conn, "psql_clone_tree", path, "SELECT s.id FROM clone_map m JOIN dir s ON s.id = m.id"
+		" WHERE s.mode & 16384 = 0 FOR UPDATE OF s",
+		0, NULL, NULL, NULL, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	dbres = PQexecParams( conn, "SELECT DISTINCT e.dir_id FROM clone_map m JOIN extent e ON e.dir_id = m.id",
+		0, NULL, NULL, NULL, NULL, 1 );
+	if( PQresultStatus( dbres ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_clone_tree for path '%s': %s",
+			path, PQerrorMessage( conn ) );
+		res = psql_error( dbres );
+		PQclear( dbres );
+		return res;
+	}
+	
+	for( i = 0; i < PQntuples( dbres ) && res >= 0; i++ ) {
+		res = psql_compact_file( conn, default_block_size,
+			be64toh( *( (int64_t *)PQgetvalue( dbres, i, 0 ) ) ), path, 0 );
+	}
+	PQclear( dbres );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* files in the tree sharing a set add one reference each, a set
+	 * shared for the first time has its file as second reference */
+	res = psql_exec( conn, "psql_clone_tree", path, "INSERT INTO block_set( dir_id, generation, refcount )"
+		" SELECT coalesce( s.block_set, s.id ), s.generation, count( * ) + 1"
+		" FROM clone_map m JOIN dir s ON s.id = m.id"
+		" WHERE s.mode & 16384 = 0 AND s.inline_data IS NULL AND s.lo_oid IS NULL"
+		" GROUP BY coalesce( s.block_set, s.id ), s.generation"
+		" ON CONFLICT ( dir_id, generation ) DO UPDATE SET refcount = block_set.refcount + EXCLUDED.refcount - 1",
+		0, NULL, NULL, NULL, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = psql_exec( conn, "psql_clone_tree", path, "UPDATE dir s SET block_set = s.id FROM clone_map m"
+		" WHERE s.id = m.id AND s.block_set IS NULL AND s.mode & 16384 = 0"
+		" AND s.inline_data IS NULL AND s.lo_oid IS NULL",
+		0, NULL, NULL, NULL, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	res = psql_exec( conn, "psql_clone_tree", path, "INSERT INTO dir( id, parent_id, name, size, mode, uid, gid,"
+		" ctime, mtime, atime, block_size, inline_data, lo_oid, codec, generation, block_set )"
+		" SELECT m.new_id, CASE WHEN s.id = $1::bigint THEN $2::bigint ELSE p.new_id END,"
+		" CASE WHEN s.id = $1::bigint THEN $3::varchar ELSE s.name END, s.size, s.mode & ~$4::integer,"
+		" s.uid, s.gid, now( ), s.mtime, s.atime, s.block_size, s.inline_data,"
+		" s.lo_oid, s.codec, s.generation, s.block_set"
+		" FROM clone_map m JOIN dir s ON s.id = m.id LEFT JOIN clone_map p ON p.id = s.parent_id",
+		4, values, lengths, binary, -1 );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	/* in a group transaction the table would live until its commit */
+	return psql_exec( conn, "psql_clone_tree", path, "DROP TABLE clone_map",
+		0, NULL, NULL, NULL, -1 );
+}
+
 int psql_begin( PGconn *conn )
 {
 	PGresult *res;
 	
+#ifdef LIBPQ_HAS_PIPELINING
+	if( PQpipelineStatus( conn ) != PQ_PIPELINE_OFF ) {
+		return psql_exec( conn, "psql_begin", "", "BEGIN", 0, NULL, NULL, NULL, -1 );
+	}
+#endif
+	
 	res = PQexec( conn, "BEGIN" );
 	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
@@ -817,12 +2764,21 @@ int psql_begin( PGconn *conn )
 int psql_commit( PGconn *conn )
 {
 	PGresult *res;
+	int ok;
+	
+#ifdef LIBPQ_HAS_PIPELINING
+	if( PQpipelineStatus( conn ) != PQ_PIPELINE_OFF ) {
+		return psql_exec( conn, "psql_commit", "", "COMMIT", 0, NULL, NULL, NULL, -1 );
+	}
+#endif
 	
 	res = PQexec( conn, "COMMIT" );
 	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Commit of transaction failed!!" );
-		return -EIO;
+		ok = psql_error( res );
+		PQclear( res );
+		return ok;
 	}
 	
 	PQclear( res );
@@ -834,6 +2790,12 @@ int psql_rollback( PGconn *conn )
 {
 	PGresult *res;
 	
+#ifdef LIBPQ_HAS_PIPELINING
+	if( PQpipelineStatus( conn ) != PQ_PIPELINE_OFF ) {
+		return psql_exec( conn, "psql_rollback", "", "ROLLBACK", 0, NULL, NULL, NULL, -1 );
+	}
+#endif
+	
 	res = PQexec( conn, "ROLLBACK" );
 	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
@@ -846,6 +2808,43 @@ int psql_rollback( PGconn *conn )
 	return 0;
 }
 
+int psql_set_async_commit( PGconn *conn )
+{
+	PGresult *res;
+	
+	res = PQexec( conn, "SET synchronous_commit TO off" );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Switching to asynchronous commit failed: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+int psql_sync( PGconn *conn )
+{
+	PGresult *res;
+	
+	/* a transaction with a transaction id committing synchronously
+	 * waits until the WAL is flushed up to its commit record, so all
+	 * asynchronous commits before are durable afterwards */
+	res = PQexec( conn, "BEGIN; SET LOCAL synchronous_commit TO on; SELECT txid_current( ); COMMIT" );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Synchronous commit failed: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
 int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_id, const int64_t to_parent_id, const char *rename_to, const char *from, const char *to )
 {
 	PgMeta from_parent_meta;
@@ -857,6 +2856,7 @@ int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_
 	int lengths[3] = { sizeof( param1 ), strlen( rename_to ), sizeof( param3 ) };
 	int binary[3] = { 1, 0, 1 };
 	PGresult *res;
+	int ok;
 	
 	id = psql_read_meta( conn, from_parent_id, from, &from_parent_meta );
 	if( id < 0 ) {
@@ -886,8 +2886,9 @@ int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Error in psql_rename for '%s' to '%s': %s", 
 			from, to, PQerrorMessage( conn ) );
+		ok = psql_error( res );
 		PQclear( res );
-		return -EIO;
+		return ok;
 	}
 
 	if( atoi( PQcmdTuples( res ) ) != 1 ) {
@@ -907,25 +2908,53 @@ size_t psql_get_block_size( PGconn *conn, const size_t block_size )
 	PGresult *res;
 	char *data;
 	size_t db_block_size;
+	char sql[128];
 	
-	res = PQexec( conn, "SELECT distinct octet_length(data) FROM data" );
+	/* blocks are not padded, so the block size is recorded in the root
+	 * directory when the filesystem is mounted first */
+	res = PQexec( conn, "SELECT block_size FROM dir WHERE id=0" );
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_get_block_size: %s", PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
-
-	/* empty, this is ok, any blocksize acceptable after initialization */
-	if( PQntuples( res ) == 0 ) {
+	
+	if( PQntuples( res ) == 1 && !PQgetisnull( res, 0, 0 ) ) {
+		data = PQgetvalue( res, 0, 0 );
+		db_block_size = atoi( data );
 		PQclear( res );
-		return block_size;
+		return db_block_size;
 	}
-
-	data = PQgetvalue( res, 0, 0 );
-	db_block_size = atoi( data );
 	
 	PQclear( res );
 	
+	/* databases written before have padded blocks of the block size */
+	res = PQexec( conn, "SELECT max(octet_length(data)) FROM data" );
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_get_block_size: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	/* empty, this is ok, any blocksize acceptable after initialization */
+	if( PQntuples( res ) == 0 || PQgetisnull( res, 0, 0 ) ) {
+		db_block_size = block_size;
+	} else {
+		data = PQgetvalue( res, 0, 0 );
+		db_block_size = atoi( data );
+	}
+	
+	PQclear( res );
+	
+	/* a read-only user can't record it, we check again next time */
+	sprintf( sql, "UPDATE dir SET block_size=%zu WHERE id=0", db_block_size );
+	res = PQexec( conn, sql );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_WARNING, "Unable to record block size in psql_get_block_size: %s",
+			PQerrorMessage( conn ) );
+	}
+	PQclear( res );
+	
 	return db_block_size;
 }
 
@@ -943,7 +2972,7 @@ int64_t psql_get_fs_blocks_used( PGconn *conn )
 	 * must consider a 'stats' table which is periodically updated
 	 * (not constantly in order to avoid a hot-spot in the database!)
 	 */
-	res = PQexec( conn, "SELECT (SELECT COUNT(*) FROM data) + (SELECT COUNT(*) FROM dir)" );
+	res = PQexec( conn, "SELECT (SELECT COUNT(*) FROM data WHERE content_id IS NULL) + (SELECT COUNT(*) FROM content) + (SELECT COUNT(*) FROM dir)" );
         if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
                 syslog( LOG_ERR, "Error in psql_get_fs_blocks_used: %s", PQerrorMessage( conn ) );
                 PQclear( res );
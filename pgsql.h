@@ -37,37 +37,38 @@ typedef struct PgMeta {
 	struct timespec ctime;	/* last status change time */
 	struct timespec mtime;	/* last modification time */
 	struct timespec atime;	/* last access time */
-	int64_t parent_id;		/* id/inode_no of parenting directory */
+	int64_t parent_id;		/* id/inode_no of parenting directory, -1 if unlinked */
+	size_t block_size;	/* block size of the file, 0 for the one of the filesystem */
+	Oid lo_oid;		/* large object with the data, InvalidOid if stored in blocks */
+	int codec;		/* how the blocks are stored, PSQL_CODEC_XXX */
 } PgMeta;
 
-/* --- transaction management and policies --- */
-#define PSQL_BEGIN( T ) \
-	{ \
-		int __res; \
-		__res = psql_begin( T ); \
-		if( __res < 0 ) return __res; \
-	}
-
-#define PSQL_COMMIT( T ) \
-	{ \
-		int __res; \
-		__res = psql_commit( T ); \
-		if( __res < 0 ) return __res; \
-	}
-
-#define PSQL_ROLLBACK( T ) \
-	{ \
-		int __res; \
-		__res = psql_rollback( T ); \
-		if( __res < 0 ) return __res; \
-	}
+/* --- storage engines for the file data --- */
+
+#define PSQL_ENGINE_BLOCKS	0	/* writes update the blocks in place */
+#define PSQL_ENGINE_LOG		1	/* partial writes append extents, compacted later */
+
+/* --- how the blocks of a file are stored, flags --- */
 
+#define PSQL_CODEC_NONE		0	/* blocks are stored as they are */
+#define PSQL_CODEC_FRAMED	1	/* blocks are frames, compressed if it pays off */
+#define PSQL_CODEC_DEDUP	2	/* full blocks are stored once in 'content' */
+
+/* --- transaction management and policies --- */
 int psql_begin( PGconn *conn );
 
 int psql_commit( PGconn *conn );
 
 int psql_rollback( PGconn *conn );
 
+int psql_set_async_commit( PGconn *conn );
+
+int psql_sync( PGconn *conn );
+
+int psql_pipeline_begin( PGconn *conn );
+
+int psql_pipeline_end( PGconn *conn );
+
 /* --- the filesystem functions --- */
 
 int64_t psql_path_to_id( PGconn *conn, const char *path );
@@ -78,21 +79,49 @@ int64_t psql_read_meta_from_path( PGconn *conn, const char *path, PgMeta *meta )
 
 int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta meta );
 
-int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta );
+int psql_write_size( PGconn *conn, const int64_t id, const char *path, const int64_t size, const struct timespec mtime );
 
-int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose );
+int64_t psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta );
+
+int psql_read_buf( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose );
+
+int psql_read_link( PGconn *conn, const int64_t id, const char *path, char *buf, const size_t size );
 
 int psql_readdir( PGconn *conn, const int64_t parent_id, void *buf, fuse_fill_dir_t filler );
 
-int psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, const char *new_dir, PgMeta meta );
+int64_t psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, const char *new_dir, PgMeta meta );
 
 int psql_delete_dir( PGconn *conn, const int64_t id, const char *path );
 
 int psql_delete_file( PGconn *conn, const int64_t id, const char *path );
 
-int psql_write_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len, int verbose );
+int psql_reap_candidates( PGconn *conn, const int64_t after_id, int64_t *ids, int *unlinked, const size_t max_ids );
+
+int psql_reap_file( PGconn *conn, const int64_t id, const char *path, const size_t batch );
+
+int psql_reap_sets( PGconn *conn, const size_t batch );
+
+int psql_write_buf( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const Oid lo_oid, const int codec, const char *path, const char *buf, const off_t offset, const size_t len, const int64_t size, int verbose );
+
+size_t psql_next_block_size( const size_t block_size, const int64_t size, const int64_t end );
+
+int psql_write_block_size( PGconn *conn, const int64_t id, const char *path, const size_t block_size );
+
+int psql_write_inline( PGconn *conn, const size_t block_size, const int codec, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len, const int64_t size );
+
+int64_t psql_lo_migrate( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const char *path );
+
+int psql_truncate( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const char *path, const off_t offset );
+
+int psql_punch_hole( PGconn *conn, const size_t block_size, const int engine, const int64_t id, const char *path, const off_t offset, const off_t len );
+
+int psql_clone_file( PGconn *conn, const size_t default_block_size, const int64_t from_id, const int64_t id, const char *path );
+
+int psql_clone_tree( PGconn *conn, const size_t default_block_size, const int64_t from_id, const int64_t parent_id, const char *name, const mode_t mask, const char *path );
+
+int psql_compact_file( PGconn *conn, const size_t block_size, const int64_t id, const char *path, int verbose );
 
-int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const off_t offset );
+int psql_compact_candidates( PGconn *conn, int64_t *ids, const size_t max_ids );
 
 int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_id, const int64_t to_parent_id, const char *rename_to, const char *from, const char *to );
 
@@ -22,10 +22,12 @@
 #include <stdlib.h>		/* for malloc */
 #include <syslog.h>		/* for syslog */
 
+#include "pgsql.h"		/* for psql_set_async_commit */
+
 #define AVAILABLE -1
 #define ERROR -2
 
-int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections )
+int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections, const int async_commit )
 {
 	size_t i;
 	int res;
@@ -61,7 +63,12 @@ int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_con
 	for( i = 0; i < max_connections; i++ ) {
 		pool->conns[i] = PQconnectdb( conninfo );
 		if( PQstatus( pool->conns[i] ) == CONNECTION_OK ) {
-			pool->avail[i] = AVAILABLE;
+			if( async_commit && psql_set_async_commit( pool->conns[i] ) < 0 ) {
+				PQfinish( pool->conns[i] );
+				pool->avail[i] = ERROR;
+			} else {
+				pool->avail[i] = AVAILABLE;
+			}
 		} else {
 			syslog( LOG_ERR, "Connection to database failed: %s",
 				PQerrorMessage( pool->conns[i]) );
@@ -140,6 +147,36 @@ PGconn *psql_pool_acquire( PgConnPool *pool )
 	return NULL;
 }
 
+/* like psql_pool_acquire, but returns NULL instead of waiting */
+PGconn *psql_pool_try_acquire( PgConnPool *pool )
+{
+	int res;
+	size_t i;
+
+	res = pthread_mutex_lock( &pool->lock );
+	if( res < 0 ) {
+		syslog( LOG_ERR, "Locking mutex failed for thread '%u': %d",
+			(unsigned int)pthread_self( ), res );
+		return NULL;
+	}
+	
+	for( i = 0; i < pool->size; i++ ) {
+		if( pool->avail[i] == AVAILABLE ) {
+			if( PQstatus( pool->conns[i] ) == CONNECTION_OK ) {
+				pool->avail[i] = pthread_self( );
+				(void)pthread_mutex_unlock( &pool->lock );
+				return pool->conns[i];
+			} else {
+				pool->avail[i] = ERROR;
+			}
+		}
+	}
+	
+	(void)pthread_mutex_unlock( &pool->lock );
+	
+	return NULL;
+}
+
 int psql_pool_release( PgConnPool *pool, PGconn *conn )
 {
 	int res;
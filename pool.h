@@ -32,12 +32,14 @@ typedef struct PgConnPool {
 	pthread_cond_t cond;	/* condition signalling a free connection */
 } PgConnPool;
 
-int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections );
+int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections, const int async_commit );
 
 int psql_pool_destroy( PgConnPool *pool );
 
 PGconn *psql_pool_acquire( PgConnPool *pool );
 
+PGconn *psql_pool_try_acquire( PgConnPool *pool );
+
 int psql_pool_release( PgConnPool *pool, PGconn *conn );
 
 #endif
@@ -0,0 +1,252 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "reap.h"
+
+#include <string.h>		/* for memset */
+#include <stdio.h>		/* for snprintf */
+#include <errno.h>		/* for ENOENT and friends */
+#include <syslog.h>		/* for syslog */
+#include <inttypes.h>		/* for PRIxxx macros */
+#include <time.h>		/* for clock_gettime */
+
+#include "pgsql.h"		/* for psql_reap_file, psql_reap_sets */
+#include "config.h"		/* compiled in defaults */
+
+/* unlink only detaches the directory entry of a file, the reaper deletes
+ * its data in small transactions with a rest after each, so neither the
+ * unlink nor other writers wait for it. Files left behind by a crash are
+ * found the same way. Truncating a file leaves the blocks of its older
+ * generations to the reaper, too, so do the last clones sharing a set of
+ * blocks */
+
+/* one batch of file 'id', of the unused shared sets for an id of -1 */
+static int reap_batch( PgReaper *reaper, const int64_t id, const char *path )
+{
+	PGresult *res;
+	int rc;
+
+	res = PQexec( reaper->conn, "BEGIN" );
+	rc = ( PQresultStatus( res ) == PGRES_COMMAND_OK ) ? 0 : -EIO;
+	PQclear( res );
+
+	if( rc == 0 ) {
+		if( id < 0 ) {
+			rc = psql_reap_sets( reaper->conn, REAP_BATCH );
+		} else {
+			rc = psql_reap_file( reaper->conn, id, path, REAP_BATCH );
+		}
+
+		res = PQexec( reaper->conn, rc < 0 ? "ROLLBACK" : "COMMIT" );
+		if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+			rc = -EIO;
+		}
+		PQclear( res );
+	}
+
+	if( rc < 0 ) {
+		syslog( LOG_ERR, "Reaping '%s' failed: %s",
+			path, PQerrorMessage( reaper->conn ) );
+	}
+
+	return rc;
+}
+
+/* rest for 'ms' milliseconds, returns 1 if the reaper has to stop. The
+ * caller must hold the lock of the reaper */
+static int reap_rest( PgReaper *reaper, const unsigned int ms )
+{
+	struct timespec deadline;
+
+	(void)clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += ( ms % 1000 ) * 1000000L;
+	if( deadline.tv_nsec >= 1000000000L ) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	if( !reaper->stop ) {
+		(void)pthread_cond_timedwait( &reaper->cond, &reaper->lock, &deadline );
+	}
+
+	return reaper->stop;
+}
+
+/* returns 1 if the file is reaped, -1 if the reaper has to stop */
+static int reap_file( PgReaper *reaper, const int64_t id, const int unlinked )
+{
+	PgFuseFile *f;
+	char path[64];
+	int rc;
+	int stop = 0;
+
+	snprintf( path, sizeof( path ), "#%"PRIi64, id );
+
+	/* an open unlinked file is still read and written, it's reaped later,
+	 * older generations of a file are never seen by its handles */
+	if( unlinked ) {
+		f = file_table_lookup( reaper->files, id );
+		if( f != NULL ) {
+			(void)file_table_close( reaper->files, f );
+			return 0;
+		}
+	}
+
+	if( reaper->verbose ) {
+		syslog( LOG_DEBUG, "Reaping %s file '%s'",
+			unlinked ? "unlinked" : "truncated", path );
+	}
+
+	do {
+		rc = reap_batch( reaper, id, path );
+		if( rc > 0 ) {
+			(void)pthread_mutex_lock( &reaper->lock );
+			stop = reap_rest( reaper, REAP_PAUSE );
+			(void)pthread_mutex_unlock( &reaper->lock );
+		}
+	} while( rc > 0 && !stop );
+
+	if( stop ) {
+		return -1;
+	}
+
+	return ( rc == 0 ) ? 1 : 0;
+}
+
+/* blocks of shared sets nobody refers to anymore, returns -1 if the
+ * reaper has to stop */
+static int reap_sets( PgReaper *reaper )
+{
+	int rc;
+	int stop = 0;
+
+	do {
+		rc = reap_batch( reaper, -1, "shared blocks" );
+		if( rc > 0 ) {
+			(void)pthread_mutex_lock( &reaper->lock );
+			stop = reap_rest( reaper, REAP_PAUSE );
+			(void)pthread_mutex_unlock( &reaper->lock );
+		}
+	} while( rc > 0 && !stop );
+
+	return stop ? -1 : 0;
+}
+
+static void *reap_thread( void *arg )
+{
+	PgReaper *reaper = (PgReaper *)arg;
+	int64_t ids[REAP_MAX_FILES];
+	int unlinked[REAP_MAX_FILES];
+	int64_t last_id = -1;
+	int nof_ids;
+	int i;
+
+	(void)pthread_mutex_lock( &reaper->lock );
+
+	/* the first run right away, for files of an earlier mount */
+	while( !reaper->stop ) {
+		(void)pthread_mutex_unlock( &reaper->lock );
+
+		nof_ids = psql_reap_candidates( reaper->conn, last_id, ids, unlinked, REAP_MAX_FILES );
+		for( i = 0; i < nof_ids; i++ ) {
+			if( reap_file( reaper, ids[i], unlinked[i] ) < 0 ) {
+				break;
+			}
+		}
+
+		/* a full page is followed by the next one, so files which are
+		 * still open can't hold up the ones behind them. The run ends
+		 * with a page which is not full */
+		if( nof_ids == REAP_MAX_FILES ) {
+			last_id = ids[nof_ids - 1];
+		} else {
+			last_id = -1;
+			if( i == nof_ids ) {
+				(void)reap_sets( reaper );
+			}
+		}
+
+		(void)pthread_mutex_lock( &reaper->lock );
+
+		if( last_id < 0 ) {
+			(void)reap_rest( reaper, reaper->interval * 1000 );
+		}
+	}
+
+	(void)pthread_mutex_unlock( &reaper->lock );
+
+	return NULL;
+}
+
+int reap_init( PgReaper *reaper, const char *conninfo, PgFileTable *files, const unsigned int interval, int verbose )
+{
+	int res;
+
+	memset( reaper, 0, sizeof( PgReaper ) );
+	reaper->files = files;
+	reaper->interval = interval;
+	reaper->verbose = verbose;
+
+	reaper->conn = PQconnectdb( conninfo );
+	if( PQstatus( reaper->conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database failed: %s",
+			PQerrorMessage( reaper->conn ) );
+		PQfinish( reaper->conn );
+		return -EIO;
+	}
+
+	res = pthread_mutex_init( &reaper->lock, NULL );
+	if( res != 0 ) {
+		PQfinish( reaper->conn );
+		return -res;
+	}
+
+	res = pthread_cond_init( &reaper->cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &reaper->lock );
+		PQfinish( reaper->conn );
+		return -res;
+	}
+
+	res = pthread_create( &reaper->thread, NULL, reap_thread, reaper );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &reaper->cond );
+		(void)pthread_mutex_destroy( &reaper->lock );
+		PQfinish( reaper->conn );
+		return -res;
+	}
+
+	return 0;
+}
+
+int reap_destroy( PgReaper *reaper )
+{
+	(void)pthread_mutex_lock( &reaper->lock );
+	reaper->stop = 1;
+	(void)pthread_cond_signal( &reaper->cond );
+	(void)pthread_mutex_unlock( &reaper->lock );
+
+	(void)pthread_join( reaper->thread, NULL );
+
+	PQfinish( reaper->conn );
+
+	(void)pthread_cond_destroy( &reaper->cond );
+	(void)pthread_mutex_destroy( &reaper->lock );
+
+	return 0;
+}
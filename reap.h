@@ -0,0 +1,44 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REAP_H
+#define REAP_H
+
+#include <sys/types.h>		/* size_t */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <pthread.h>		/* for mutex and conditionals */
+
+#include "file.h"		/* for PgFileTable */
+
+typedef struct PgReaper {
+	PGconn *conn;		/* connection of the reaper thread */
+	PgFileTable *files;	/* open files, they are reaped after they are closed */
+	unsigned int interval;	/* seconds between two reaper runs */
+	int verbose;		/* whether we should be verbose */
+	int stop;		/* tells the reaper thread to terminate */
+	pthread_t thread;	/* deletes the data of unlinked files */
+	pthread_mutex_t lock;	/* protects stop */
+	pthread_cond_t cond;	/* signals termination */
+} PgReaper;
+
+int reap_init( PgReaper *reaper, const char *conninfo, PgFileTable *files, const unsigned int interval, int verbose );
+
+int reap_destroy( PgReaper *reaper );
+
+#endif
@@ -157,6 +157,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr( -, root, root )
 %{_bindir}/pgfuse
+%{_bindir}/pgclone
 %{_datadir}/man/man1/pgfuse.1.gz
 %dir %{_datadir}/%{name}-%{version}
 %{_datadir}/%{name}-%{version}/schema.sql
@@ -1,3 +1,13 @@
+-- small files and symlink targets are stored in 'inline_data' of their
+-- directory entry instead of in 'data', NULL for files stored in blocks,
+-- huge files in the large object 'lo_oid' (option 'lothreshold'),
+-- 'codec' has the flags 1 for blocks stored as compressed frames (option
+-- 'compress') and 2 for blocks stored in 'content' (option 'dedup').
+-- Unlinked files have no 'parent_id', their data is deleted in the
+-- background, the entry last. Truncating a file starts a new 'generation'
+-- of its blocks, the older ones are deleted in the background while the
+-- file is 'stale'. A file reads the blocks of 'block_set' instead of its
+-- own if set, those are shared with its clones, see table 'block_set'
 CREATE TABLE dir (
 	id BIGSERIAL,
 	parent_id BIGINT,
@@ -9,37 +19,180 @@ CREATE TABLE dir (
 	ctime TIMESTAMP,
 	mtime TIMESTAMP,
 	atime TIMESTAMP,
+	block_size INTEGER,
+	inline_data BYTEA,
+	lo_oid OID,
+	codec INTEGER,
+	generation BIGINT NOT NULL DEFAULT 0,
+	stale BOOLEAN NOT NULL DEFAULT false,
+	block_set BIGINT,
 	PRIMARY KEY( id ),
 	FOREIGN KEY( parent_id ) REFERENCES dir( id ),
 	UNIQUE( name, parent_id )
 );
 
--- TODO: 4096 is STANDARD_BLOCK_SIZE in config.h, must be in sync!
+-- blocks of files written with the option 'dedup' are stored once here,
+-- found by the SHA-256 hash of their data and the codec (1 for frames).
+-- Blocks in 'data' refer to them by 'content_id' instead of having data.
+-- Writers count their references, the trigger 'data_content' drops them
+CREATE TABLE content (
+	id BIGSERIAL,
+	hash BYTEA,
+	codec INTEGER NOT NULL,
+	refcount BIGINT NOT NULL DEFAULT 0,
+	data BYTEA,
+	PRIMARY KEY( id ),
+	UNIQUE( hash, codec )
+);
+
+ALTER TABLE content ALTER COLUMN data SET STORAGE EXTERNAL;
+
+-- the block size is recorded in 'block_size' of the root directory on
+-- the first mount, blocks are not padded, the last block of a file is
+-- stored with its real length. Only the blocks of the current 'generation'
+-- of the file are part of it. Blocks of a shared set outlive the entry
+-- which wrote them, so 'dir_id' is no foreign key
 CREATE TABLE data (
 	dir_id BIGINT,
+	generation BIGINT NOT NULL DEFAULT 0,
 	block_no BIGINT NOT NULL DEFAULT 0,
 	data BYTEA,
-	PRIMARY KEY( dir_id, block_no ),
-	FOREIGN KEY( dir_id ) REFERENCES dir( id )
+	content_id BIGINT,
+	PRIMARY KEY( dir_id, generation, block_no ),
+	FOREIGN KEY( content_id ) REFERENCES content( id )
 );
 
+-- storage profile of the blocks: partial writes and truncation work with
+-- overlay and substring on the value, a compressed value is decompressed
+-- and compressed again as a whole for that. Measure with 'make bench' in
+-- tests and pick one:
+-- EXTERNAL: out of line, not compressed, substrings read only the slices
+--           they need (default, also best with the option 'compress')
+-- MAIN:     compressed in the row, for compressible data written in
+--           whole blocks, small block sizes only
+-- EXTENDED: the PostgreSQL default, with 'SET COMPRESSION lz4' (14 and
+--           later) the cost of recompressing is lower
+ALTER TABLE data ALTER COLUMN data SET STORAGE EXTERNAL;
+-- ALTER TABLE data ALTER COLUMN data SET STORAGE MAIN;
+-- ALTER TABLE data ALTER COLUMN data SET COMPRESSION lz4;
+
 -- create indexes for fast data access
 CREATE INDEX data_dir_id_idx ON data( dir_id );
 CREATE INDEX data_block_no_idx ON data( block_no );
 
+-- new generations are numbered from a sequence, so a file leaving a
+-- shared set never meets blocks left under its id
+CREATE SEQUENCE generation_seq;
+
+-- the blocks of a generation shared by clones (pgclone), 'refcount' is
+-- the number of entries with it as 'block_set' and 'generation'. The first
+-- write of a clone copies the blocks to its own generation, sets nobody
+-- refers to anymore are deleted by the reaper
+CREATE TABLE block_set (
+	dir_id BIGINT,
+	generation BIGINT,
+	refcount BIGINT NOT NULL,
+	PRIMARY KEY( dir_id, generation )
+);
+
+CREATE INDEX block_set_unused_idx ON block_set( dir_id, generation ) WHERE refcount = 0;
+
+-- partial block writes of the log engine (option 'logwrite'), applied
+-- in order of id on top of the block, folded into 'data' by compaction
+CREATE TABLE extent (
+	id BIGSERIAL,
+	dir_id BIGINT NOT NULL,
+	block_no BIGINT NOT NULL,
+	"offset" INTEGER NOT NULL,
+	data BYTEA,
+	PRIMARY KEY( id ),
+	FOREIGN KEY( dir_id ) REFERENCES dir( id )
+);
+
+CREATE INDEX extent_dir_id_block_no_idx ON extent( dir_id, block_no, id );
+
 -- create an index on the parent_id for
 -- directory listings
 CREATE INDEX dir_parent_id_idx ON dir( parent_id );
 
+-- truncated files with blocks of older generations left for the reaper
+CREATE INDEX dir_stale_idx ON dir( id ) WHERE stale;
+
 -- 16384 == S_IFDIR (S_IFDIR)
 -- TODO: should be created by the program after checking the OS
 -- it is running on (for full POSIX compatibility)
 
 -- garbage collect deleted file entries, delete all blocks in 'data'
+-- which are not in a shared set and all extents in 'extent', drop the
+-- reference to the shared set
 CREATE OR REPLACE RULE "dir_remove" AS ON
 	DELETE TO dir WHERE OLD.mode & 16384 = 0
-	DO ALSO DELETE FROM data WHERE dir_id=OLD.id;	
-	
+	DO ALSO ( UPDATE block_set SET refcount = refcount - 1
+			WHERE dir_id=OLD.block_set AND generation=OLD.generation;
+		DELETE FROM data WHERE dir_id=OLD.id AND NOT EXISTS ( SELECT 1 FROM block_set b
+			WHERE b.dir_id = data.dir_id AND b.generation = data.generation );
+		DELETE FROM extent WHERE dir_id=OLD.id );
+
+-- clones share the large object, it is unlinked with its last entry
+CREATE INDEX dir_lo_oid_idx ON dir( lo_oid ) WHERE lo_oid IS NOT NULL;
+
+CREATE OR REPLACE FUNCTION dir_lo_unlink( ) RETURNS TRIGGER AS $$
+BEGIN
+	PERFORM 1 FROM dir WHERE lo_oid = OLD.lo_oid FOR UPDATE;
+	IF NOT FOUND THEN
+		PERFORM lo_unlink( OLD.lo_oid );
+	END IF;
+	RETURN OLD;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER dir_lo_remove AFTER DELETE ON dir
+	FOR EACH ROW WHEN ( OLD.lo_oid IS NOT NULL )
+	EXECUTE PROCEDURE dir_lo_unlink( );
+
+CREATE TRIGGER dir_lo_replace AFTER UPDATE OF lo_oid ON dir
+	FOR EACH ROW WHEN ( OLD.lo_oid IS NOT NULL AND OLD.lo_oid IS DISTINCT FROM NEW.lo_oid )
+	EXECUTE PROCEDURE dir_lo_unlink( );
+
+-- the large object of a file before a write, a shared one is copied
+-- first, in pieces of a megabyte
+CREATE OR REPLACE FUNCTION dir_own_lo( entry BIGINT ) RETURNS OID AS $$
+DECLARE
+	old_oid OID;
+	new_oid OID;
+	chunk BYTEA;
+	n BIGINT := 0;
+BEGIN
+	SELECT lo_oid INTO old_oid FROM dir WHERE id = entry FOR UPDATE;
+	IF old_oid IS NULL OR NOT EXISTS ( SELECT 1 FROM dir WHERE lo_oid = old_oid AND id <> entry ) THEN
+		RETURN old_oid;
+	END IF;
+	new_oid := lo_create( 0 );
+	LOOP
+		chunk := lo_get( old_oid, n * 1048576, 1048576 );
+		PERFORM lo_put( new_oid, n * 1048576, chunk );
+		EXIT WHEN octet_length( chunk ) < 1048576;
+		n := n + 1;
+	END LOOP;
+	UPDATE dir SET lo_oid = new_oid WHERE id = entry;
+	RETURN new_oid;
+END;
+$$ LANGUAGE plpgsql;
+
+-- blocks drop their reference to shared content when they are deleted or
+-- refer to something else, content nobody refers to is deleted
+CREATE OR REPLACE FUNCTION data_content_unref( ) RETURNS TRIGGER AS $$
+BEGIN
+	UPDATE content SET refcount = refcount - 1 WHERE id = OLD.content_id;
+	DELETE FROM content WHERE id = OLD.content_id AND refcount = 0;
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER data_content AFTER UPDATE OF content_id OR DELETE ON data
+	FOR EACH ROW WHEN ( OLD.content_id IS NOT NULL )
+	EXECUTE PROCEDURE data_content_unref( );
+
 -- self-referencing anchor for root directory
 -- 16895 = S_IFDIR and 0777 permissions, belonging to root/root
 -- TODO: should be done from outside, see note above
@@ -0,0 +1,220 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <stdio.h>		/* for printf, fprintf */
+#include <stdlib.h>		/* for atoi, malloc */
+#include <string.h>		/* for memcpy */
+#include <stdint.h>		/* for int64_t */
+#include <arpa/inet.h>		/* for htonl */
+#include <sys/time.h>		/* for gettimeofday */
+
+#include "endian.h"		/* for htobe64 */
+
+/* measures the latency of partial block writes, as done by pgfuse, for
+ * the storage profiles of the column 'data' in schema.sql and different
+ * block sizes. Every block gets WRITE_SIZE octets written in the middle */
+
+#define NOF_BLOCKS	64
+#define WRITE_SIZE	512
+
+static const char *profiles[] = {
+	"SET STORAGE EXTENDED",
+	"SET STORAGE EXTERNAL",
+	"SET STORAGE MAIN",
+	"SET COMPRESSION lz4",
+	NULL
+};
+
+static const int block_sizes[] = { 4096, 65536, 1048576, 0 };
+
+static double now_us( void )
+{
+	struct timeval t;
+	
+	(void)gettimeofday( &t, NULL );
+	
+	return t.tv_sec * 1000000.0 + t.tv_usec;
+}
+
+static int exec( PGconn *conn, const char *sql )
+{
+	PGresult *res;
+	int ok;
+	
+	res = PQexec( conn, sql );
+	ok = PQresultStatus( res ) == PGRES_COMMAND_OK;
+	if( !ok ) {
+		fprintf( stderr, "%s: %s", sql, PQerrorMessage( conn ) );
+	}
+	PQclear( res );
+	
+	return ok ? 0 : -1;
+}
+
+/* fill the blocks with text, which compresses like typical file content */
+static int fill( PGconn *conn, const int block_size )
+{
+	int param1 = htonl( NOF_BLOCKS );
+	int param2 = htonl( block_size );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	PGresult *res;
+	int ok;
+	
+	res = PQexecParams( conn, "INSERT INTO bench( dir_id, block_no, data )"
+		" SELECT 0, n, substring( convert_to( repeat( md5( n::text ) || ' the quick brown fox ', $2::integer / 52 + 1 ), 'UTF8' ) from 1 for $2::integer )"
+		" FROM generate_series( 0, $1::integer - 1 ) AS n",
+		2, NULL, values, lengths, binary, 1 );
+	ok = PQresultStatus( res ) == PGRES_COMMAND_OK;
+	if( !ok ) {
+		fprintf( stderr, "fill: %s", PQerrorMessage( conn ) );
+	}
+	PQclear( res );
+	
+	return ok ? 0 : -1;
+}
+
+/* the partial write of psql_write_block, returns microseconds per write */
+static double partial_writes( PGconn *conn, const int block_size )
+{
+	char buf[WRITE_SIZE];
+	int64_t param1 = htobe64( 0 );
+	int64_t param2;
+	int param4 = htonl( block_size / 2 );
+	const char *values[4] = { (const char *)&param1, (const char *)&param2, buf, (const char *)&param4 };
+	int lengths[4] = { sizeof( param1 ), sizeof( param2 ), WRITE_SIZE, sizeof( param4 ) };
+	int binary[4] = { 1, 1, 1, 1 };
+	PGresult *res;
+	double start;
+	int i;
+	
+	memset( buf, 'x', WRITE_SIZE );
+	
+	start = now_us( );
+	for( i = 0; i < NOF_BLOCKS; i++ ) {
+		param2 = htobe64( i );
+		res = PQexecParams( conn, "UPDATE bench SET data = overlay("
+			" data || repeat(E'\\\\000',greatest( $4::integer - octet_length( data ), 0 ))::bytea"
+			" placing $3::bytea from $4::integer + 1 ) WHERE dir_id=$1::bigint AND block_no=$2::bigint",
+			4, NULL, values, lengths, binary, 1 );
+		if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+			fprintf( stderr, "partial write: %s", PQerrorMessage( conn ) );
+			PQclear( res );
+			return -1;
+		}
+		PQclear( res );
+	}
+	
+	return ( now_us( ) - start ) / NOF_BLOCKS;
+}
+
+/* the read of the middle of a block, like a small read of a file */
+static double partial_reads( PGconn *conn, const int block_size )
+{
+	int64_t param1;
+	int param2 = htonl( block_size / 2 );
+	const char *values[2] = { (const char *)&param1, (const char *)&param2 };
+	int lengths[2] = { sizeof( param1 ), sizeof( param2 ) };
+	int binary[2] = { 1, 1 };
+	PGresult *res;
+	double start;
+	int i;
+	
+	start = now_us( );
+	for( i = 0; i < NOF_BLOCKS; i++ ) {
+		param1 = htobe64( i );
+		res = PQexecParams( conn, "SELECT substring( data from $2::integer + 1 for 512 ) FROM bench WHERE dir_id=0 AND block_no=$1::bigint",
+			2, NULL, values, lengths, binary, 1 );
+		if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+			fprintf( stderr, "partial read: %s", PQerrorMessage( conn ) );
+			PQclear( res );
+			return -1;
+		}
+		PQclear( res );
+	}
+	
+	return ( now_us( ) - start ) / NOF_BLOCKS;
+}
+
+int main( int argc, char *argv[] )
+{
+	PGconn *conn;
+	PGresult *res;
+	char sql[128];
+	double write_us;
+	double read_us;
+	int p;
+	int b;
+	
+	if( argc != 2 ) {
+		fprintf( stderr, "usage: benchpartial <Pg conn info>\n" );
+		return 1;
+	}
+	
+	conn = PQconnectdb( argv[1] );
+	if( PQstatus( conn ) != CONNECTION_OK ) {
+		fprintf( stderr, "Connection to database failed: %s",
+			PQerrorMessage( conn ) );
+		PQfinish( conn );
+		return 1;
+	}
+	
+	printf( "%-22s %10s %12s %12s %12s\n", "profile", "block size", "write (us)", "read (us)", "size (kB)" );
+	
+	for( p = 0; profiles[p] != NULL; p++ ) {
+		for( b = 0; block_sizes[b] != 0; b++ ) {
+			if( exec( conn, "DROP TABLE IF EXISTS bench" ) < 0 ||
+			    exec( conn, "CREATE TEMPORARY TABLE bench( dir_id BIGINT, block_no BIGINT, data BYTEA, PRIMARY KEY( dir_id, block_no ) )" ) < 0 ) {
+				PQfinish( conn );
+				return 1;
+			}
+			
+			/* lz4 needs PostgreSQL 14 built with it */
+			snprintf( sql, sizeof( sql ), "ALTER TABLE bench ALTER COLUMN data %s", profiles[p] );
+			if( exec( conn, sql ) < 0 ) {
+				printf( "%-22s %10s\n", profiles[p], "skipped" );
+				break;
+			}
+			
+			if( fill( conn, block_sizes[b] ) < 0 ) {
+				PQfinish( conn );
+				return 1;
+			}
+			
+			write_us = partial_writes( conn, block_sizes[b] );
+			read_us = partial_reads( conn, block_sizes[b] );
+			if( write_us < 0 || read_us < 0 ) {
+				PQfinish( conn );
+				return 1;
+			}
+			
+			res = PQexec( conn, "SELECT pg_total_relation_size( 'bench' ) / 1024" );
+			printf( "%-22s %10d %12.1f %12.1f %12s\n", profiles[p], block_sizes[b],
+				write_us, read_us, PQresultStatus( res ) == PGRES_TUPLES_OK ? PQgetvalue( res, 0, 0 ) : "?" );
+			PQclear( res );
+		}
+	}
+	
+	(void)exec( conn, "DROP TABLE IF EXISTS bench" );
+	
+	PQfinish( conn );
+	
+	return 0;
+}
@@ -1,3 +1,10 @@
 DROP RULE dir_remove ON dir;
+DROP TABLE extent;
 DROP TABLE data;
+DROP TABLE block_set;
+DROP SEQUENCE generation_seq;
+DROP TABLE content;
 DROP TABLE dir;
+DROP FUNCTION data_content_unref( );
+DROP FUNCTION dir_lo_unlink( );
+DROP FUNCTION dir_own_lo( BIGINT );
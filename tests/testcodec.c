@@ -0,0 +1,97 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+#define BLOCK_SIZE 65536
+
+static char frame[CODEC_FRAME_MAX( BLOCK_SIZE )];
+static char out[BLOCK_SIZE];
+
+/* frame a block and unpack it again, returns the length of the frame */
+static int roundtrip( const char *name, const char *buf, size_t len )
+{
+	size_t n;
+	int res;
+	
+	n = codec_encode( buf, len, frame );
+	if( n > CODEC_FRAME_MAX( len ) ) {
+		fprintf( stderr, "%s: frame of %zu octets too long (%zu)\n", name, len, n );
+		return -1;
+	}
+	
+	res = codec_decode( frame, n, out, BLOCK_SIZE );
+	if( res != (int)len || memcmp( buf, out, len ) != 0 ) {
+		fprintf( stderr, "%s: data mismatch after decoding (%d octets)\n", name, res );
+		return -1;
+	}
+	
+	printf( "%s: %zu octets, frame %zu octets, codec %d\n", name, len, n, frame[0] );
+	
+	return n;
+}
+
+int main( void )
+{
+	static char buf[BLOCK_SIZE];
+	size_t i;
+	int n;
+	
+	/* text compresses */
+	for( i = 0; i < BLOCK_SIZE; i++ ) {
+		buf[i] = "the quick brown fox jumps over the lazy dog "[( i * 7 / 5 ) % 44];
+	}
+	n = roundtrip( "text", buf, BLOCK_SIZE );
+	if( n < 0 || frame[0] != CODEC_LZ || n >= BLOCK_SIZE / 2 ) {
+		fprintf( stderr, "text: expecting a compressed frame\n" );
+		return 1;
+	}
+	
+	/* random data is stored as it is */
+	srand( 42 );
+	for( i = 0; i < BLOCK_SIZE; i++ ) {
+		buf[i] = rand( ) & 0xFF;
+	}
+	n = roundtrip( "random", buf, BLOCK_SIZE );
+	if( n < 0 || frame[0] != CODEC_STORED ) {
+		fprintf( stderr, "random: expecting a stored frame\n" );
+		return 1;
+	}
+	
+	/* long matches, short blocks and the empty block */
+	memset( buf, 'x', BLOCK_SIZE );
+	if( roundtrip( "repeated", buf, BLOCK_SIZE ) < 0 ) return 1;
+	if( roundtrip( "short", "hello", 5 ) < 0 ) return 1;
+	if( roundtrip( "empty", "", 0 ) < 0 ) return 1;
+	
+	/* corrupt frames are rejected */
+	n = codec_encode( buf, BLOCK_SIZE, frame );
+	if( codec_decode( frame, n - 1, out, BLOCK_SIZE ) >= 0 ) {
+		fprintf( stderr, "truncated frame not detected\n" );
+		return 1;
+	}
+	if( codec_decode( frame, n, out, BLOCK_SIZE - 1 ) >= 0 ) {
+		fprintf( stderr, "frame bigger than the block not detected\n" );
+		return 1;
+	}
+	
+	return 0;
+}
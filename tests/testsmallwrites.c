@@ -0,0 +1,94 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#define FILE_SIZE 10000
+
+int main( void )
+{
+	char buf[FILE_SIZE];
+	char c;
+	int fd;
+	int i;
+	ssize_t res;
+	struct stat st;
+	
+	/* write octet by octet, like putc, this ends up in the write-back buffer */
+	fd = open( "./mnt/testsmallwrites.data", O_RDWR | O_CREAT | O_TRUNC,
+	    S_IRUSR | S_IWUSR );
+	if( fd < 0 ) {
+		perror( "Unable to open testfile" );
+		return 1;
+	}
+	
+	for( i = 0; i < FILE_SIZE; i++ ) {
+		c = 'a' + i % 26;
+		res = write( fd, &c, 1 );
+		if( res != 1 ) {
+			perror( "Error writing" );
+			(void)close( fd );
+			return 1;
+		}
+	}
+	
+	/* size must be visible before the buffer is flushed */
+	if( fstat( fd, &st ) < 0 ) {
+		perror( "Error in fstat" );
+		(void)close( fd );
+		return 1;
+	}
+	if( st.st_size != FILE_SIZE ) {
+		fprintf( stderr, "Expecting size %d, got %jd\n", FILE_SIZE, (intmax_t)st.st_size );
+		(void)close( fd );
+		return 1;
+	}
+	
+	/* overwrite in the middle of a block */
+	res = pwrite( fd, "XYZ", 3, 5000 );
+	if( res != 3 ) {
+		perror( "Error writing" );
+		(void)close( fd );
+		return 1;
+	}
+	
+	/* read back through the same handle */
+	res = pread( fd, buf, FILE_SIZE, 0 );
+	if( res != FILE_SIZE ) {
+		perror( "Error reading" );
+		(void)close( fd );
+		return 1;
+	}
+	
+	for( i = 0; i < FILE_SIZE; i++ ) {
+		c = ( i >= 5000 && i < 5003 ) ? "XYZ"[i - 5000] : 'a' + i % 26;
+		if( buf[i] != c ) {
+			fprintf( stderr, "Data mismatch at offset %d\n", i );
+			(void)close( fd );
+			return 1;
+		}
+	}
+	
+	(void)close( fd );
+	
+	return 0;
+}